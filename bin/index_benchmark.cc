@@ -0,0 +1,275 @@
+#include <array>
+#include <bit>
+#include <chrono>
+#include <format>
+#include <print>
+
+#include "Compiler/Command.h"
+#include "Compiler/Compilation.h"
+#include "Index/MergedIndex.h"
+#include "Index/ProjectIndex.h"
+#include "Support/FileSystem.h"
+#include "Support/Logging.h"
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA256.h"
+
+namespace cl = llvm::cl;
+using namespace clice;
+
+namespace {
+
+cl::OptionCategory category("clice index benchmark options");
+
+cl::list<std::string> compile_commands_dirs{
+    "compile-commands-dir",
+    cl::cat(category),
+    cl::value_desc("path"),
+    cl::desc("The directories to search for compile_commands.json"),
+};
+
+cl::opt<std::string> workspace{
+    "workspace",
+    cl::cat(category),
+    cl::value_desc("path"),
+    cl::init("."),
+    cl::desc("The workspace directory, default is the current directory"),
+};
+
+cl::opt<unsigned> repeat{
+    "repeat",
+    cl::cat(category),
+    cl::value_desc("unsigned int"),
+    cl::init(10),
+    cl::desc("How many times each file index is hashed, default is 10"),
+};
+
+cl::list<std::string> files{
+    cl::Positional,
+    cl::cat(category),
+    cl::desc("<files>, default are all files in the compilation database"),
+};
+
+using Clock = std::chrono::steady_clock;
+
+/// The SHA256 content hash of file indices before xxh3-128, only for comparison.
+std::array<std::uint8_t, 32> sha256(index::FileIndex& index) {
+    using u8 = std::uint8_t;
+
+    llvm::SHA256 hasher;
+    hasher.update(llvm::ArrayRef(reinterpret_cast<u8*>(index.occurrences.data()),
+                                 index.occurrences.size() * sizeof(index::Occurrence)));
+    for(auto& [symbol_id, relations]: index.relations) {
+        hasher.update(std::bit_cast<std::array<u8, sizeof(symbol_id)>>(symbol_id));
+        hasher.update(llvm::ArrayRef(reinterpret_cast<u8*>(relations.data()),
+                                     relations.size() * sizeof(index::Relation)));
+    }
+    return hasher.final();
+}
+
+struct HashStatistics {
+    std::size_t indices = 0;
+
+    std::size_t bytes = 0;
+
+    Clock::duration xxh3_time = {};
+
+    Clock::duration sha256_time = {};
+
+    void add(index::FileIndex& index) {
+        indices += 1;
+        bytes += index.occurrences.size() * sizeof(index::Occurrence);
+        for(auto& [_, relations]: index.relations) {
+            bytes += sizeof(index::SymbolHash) + relations.size() * sizeof(index::Relation);
+        }
+
+        auto begin = Clock::now();
+        for(unsigned i = 0; i < repeat; i++) {
+            index.hash();
+        }
+        xxh3_time += Clock::now() - begin;
+
+        begin = Clock::now();
+        for(unsigned i = 0; i < repeat; i++) {
+            sha256(index);
+        }
+        sha256_time += Clock::now() - begin;
+    }
+};
+
+/// The merged indices of the project, and the symbols with relations in each
+/// of them to look up after they are loaded from disk.
+struct Indices {
+    index::ProjectIndex project;
+
+    llvm::DenseMap<std::uint32_t, index::MergedIndex> merged;
+
+    llvm::DenseMap<std::uint32_t, llvm::DenseSet<index::SymbolHash>> symbols;
+
+    /// The count of entries merged, before the contexts are deduplicated.
+    std::size_t occurrences = 0;
+
+    std::size_t relations = 0;
+
+    void record(std::uint32_t path_id, index::FileIndex& index) {
+        occurrences += index.occurrences.size();
+        for(auto& [symbol, symbol_relations]: index.relations) {
+            relations += symbol_relations.size();
+            symbols[path_id].insert(symbol);
+        }
+    }
+
+    void merge(llvm::StringRef path, index::TUIndex& tu_index) {
+        auto path_id = project.path_pool.path_id(path);
+        auto path_map = project.merge(tu_index);
+
+        for(auto& [fid, file_index]: tu_index.file_indices) {
+            auto header_id = path_map[tu_index.graph.path_id(fid)];
+            auto include_id = tu_index.graph.include_location_id(fid);
+            record(header_id, file_index);
+            merged[header_id].merge(path_id, include_id, file_index);
+        }
+
+        for(auto& include: tu_index.graph.locations) {
+            include.path_id = path_map[include.path_id];
+        }
+        record(path_id, tu_index.main_file_index);
+        merged[path_id].merge(path_id,
+                              tu_index.built_at,
+                              std::move(tu_index.graph.locations),
+                              tu_index.main_file_index);
+    }
+};
+
+double milliseconds(Clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+}  // namespace
+
+int main(int argc, const char** argv) {
+    llvm::InitLLVM guard(argc, argv);
+    cl::HideUnrelatedOptions(category);
+    cl::ParseCommandLineOptions(
+        argc,
+        argv,
+        "Index the files and measure the cost of hashing, storing and loading the index");
+
+    logging::stderr_logger("clice", logging::options);
+
+    if(auto result = fs::init_resource_dir(argv[0]); !result) {
+        LOGGING_FATAL("Cannot find default resource directory, because {}", result.error());
+    }
+
+    CompilationDatabase database;
+    std::vector<std::string> dirs(compile_commands_dirs.begin(), compile_commands_dirs.end());
+    database.load_compile_database(dirs, workspace.getValue());
+
+    std::vector<std::string> inputs(files.begin(), files.end());
+    if(inputs.empty()) {
+        for(auto file: database.files()) {
+            inputs.emplace_back(file);
+        }
+    }
+
+    CommandOptions options;
+    options.resource_dir = true;
+    options.query_driver = true;
+
+    HashStatistics hashes;
+    Indices indices;
+    for(auto& file: inputs) {
+        CompilationParams params;
+        params.kind = CompilationUnit::Indexing;
+        params.arguments = database.lookup(file, options).arguments;
+
+        auto unit = compile(params);
+        if(!unit) {
+            LOGGING_WARN("Fail to index {}, because: {}", file, unit.error());
+            continue;
+        }
+
+        auto tu_index = index::TUIndex::build(*unit);
+        for(auto& [_, file_index]: tu_index.file_indices) {
+            hashes.add(file_index);
+        }
+        hashes.add(tu_index.main_file_index);
+        indices.merge(file, tu_index);
+    }
+
+    std::println("Hashed {} file indices from {} files, {} bytes, {} times each",
+                 hashes.indices,
+                 inputs.size(),
+                 hashes.bytes,
+                 repeat.getValue());
+    std::println("    xxh3-128: {:.3f} ms", milliseconds(hashes.xxh3_time));
+    std::println("    SHA256:   {:.3f} ms", milliseconds(hashes.sha256_time));
+
+    llvm::SmallString<128> directory;
+    if(auto error = llvm::sys::fs::createUniqueDirectory("clice-index-benchmark", directory)) {
+        LOGGING_FATAL("Cannot create temporary directory, because {}", error.message());
+    }
+
+    /// Compact the indices as they would be before written by the server.
+    std::size_t total_size = 0;
+    for(auto& [path_id, merged]: indices.merged) {
+        merged.compact();
+
+        llvm::SmallString<128> path = directory;
+        llvm::sys::path::append(path, std::format("{}.idx", path_id));
+
+        std::error_code error;
+        llvm::raw_fd_ostream out(path, error);
+        if(error) {
+            LOGGING_FATAL("Cannot write {}, because {}", path.str(), error.message());
+        }
+        merged.serialize(out);
+        total_size += out.tell();
+    }
+
+    /// Load every index and look up all symbols with relations in it, which
+    /// touches the entries and contexts read by the server.
+    Clock::duration load_time = {};
+    Clock::duration lookup_time = {};
+    std::size_t found = 0;
+    for(auto& [path_id, symbols]: indices.symbols) {
+        llvm::SmallString<128> path = directory;
+        llvm::sys::path::append(path, std::format("{}.idx", path_id));
+
+        auto begin = Clock::now();
+        auto merged = index::MergedIndex::load(path);
+        load_time += Clock::now() - begin;
+
+        begin = Clock::now();
+        auto kind = RelationKind(RelationKind::Declaration,
+                                 RelationKind::Definition,
+                                 RelationKind::Reference);
+        for(auto symbol: symbols) {
+            merged.lookup(symbol, kind, [&found](const index::Relation&) {
+                found += 1;
+                return true;
+            });
+        }
+        lookup_time += Clock::now() - begin;
+    }
+    llvm::sys::fs::remove_directories(directory);
+
+    /// The entries were fixed-width structs before the contexts were compressed,
+    /// 16 bytes per occurrence and 24 bytes per relation.
+    std::println("Merged {} indices, {} occurrences and {} relations before deduplication",
+                 indices.merged.size(),
+                 indices.occurrences,
+                 indices.relations);
+    std::println("    on disk:     {} bytes", total_size);
+    std::println("    fixed-width: {} bytes of entries",
+                 indices.occurrences * 16 + indices.relations * 24);
+    std::println("    load:        {:.3f} ms", milliseconds(load_time));
+    std::println("    lookup:      {:.3f} ms, {} relations found",
+                 milliseconds(lookup_time),
+                 found);
+    return 0;
+}
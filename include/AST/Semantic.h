@@ -106,6 +106,23 @@ public:
         }
     }
 
+    /// Invoked before traversing a declaration, return true to skip it and all
+    /// its children, e.g. the declarations in the files already indexed.
+    bool shouldSkipDecl(const clang::Decl* decl) {
+        return false;
+    }
+
+    bool on_traverse_decl(clang::Decl* decl, auto MF) {
+        if constexpr(!std::same_as<decltype(&SemanticVisitor::shouldSkipDecl),
+                                   decltype(&Derived::shouldSkipDecl)>) {
+            if(getDerived().shouldSkipDecl(decl)) {
+                return true;
+            }
+        }
+
+        return (this->*MF)(decl);
+    }
+
     void run() {
         if(Base::interested_only) {
             for(auto decl: unit.top_level_decls()) {
@@ -172,6 +172,10 @@ public:
 
     std::chrono::milliseconds build_duration();
 
+    /// The approximate memory usage of the unit in bytes, including the AST,
+    /// the preprocessor and the source buffers.
+    std::size_t memory_usage();
+
     clang::LangOptions& lang_options();
 
     clang::ASTContext& context();
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+
+namespace clice::index {
+
+/// A non-ASCII character in the content, whose column differs between encodings.
+struct WideChar {
+    /// The offset of the first byte of this character.
+    std::uint32_t offset;
+
+    /// The length of this character in UTF-8.
+    std::uint32_t length;
+
+    friend bool operator== (const WideChar&, const WideChar&) = default;
+};
+
+/// A view of line table, which converts offsets to lines and columns without
+/// the content.
+struct LineTableRef {
+    /// The offset of the start of each line.
+    llvm::ArrayRef<std::uint32_t> line_starts;
+
+    /// All non-ASCII characters in order.
+    llvm::ArrayRef<WideChar> wide_chars;
+
+    bool empty() const {
+        return line_starts.empty();
+    }
+
+    /// Get the zero-based line and column of the offset. The `units` returns the
+    /// count of code units of a non-ASCII character by its length in UTF-8.
+    std::pair<std::uint32_t, std::uint32_t>
+        position(std::uint32_t offset,
+                 llvm::function_ref<std::uint32_t(std::uint32_t)> units) const;
+};
+
+struct LineTable {
+    std::vector<std::uint32_t> line_starts;
+
+    std::vector<WideChar> wide_chars;
+
+    static LineTable build(llvm::StringRef content);
+
+    bool empty() const {
+        return line_starts.empty();
+    }
+
+    operator LineTableRef () const {
+        return LineTableRef{line_starts, wide_chars};
+    }
+
+    friend bool operator== (const LineTable&, const LineTable&) = default;
+};
+
+}  // namespace clice::index
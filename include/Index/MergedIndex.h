@@ -1,19 +1,55 @@
 #pragma once
 
+#include <memory>
+#include <optional>
+
 #include "TUIndex.h"
 #include "llvm/Support/Allocator.h"
 #include "llvm/Support/MemoryBuffer.h"
 
 namespace clice::index {
 
+/// The result of compacting a merged index.
+struct CompactStatistics {
+    /// The count of dropped canonical ids.
+    std::size_t canonical_ids = 0;
+
+    /// The count of dropped occurrences.
+    std::size_t occurrences = 0;
+
+    /// The count of dropped relations.
+    std::size_t relations = 0;
+
+    /// An estimation of the bytes reclaimed from the serialized index.
+    std::size_t reclaimed_bytes = 0;
+};
+
+/// The content hash of a file which a source file depends on, the same layout
+/// as in binary.
+struct DependencyHash {
+    std::uint32_t path_id;
+
+    std::uint32_t padding = 0;
+
+    std::uint64_t hash;
+
+    friend bool operator== (const DependencyHash&, const DependencyHash&) = default;
+};
+
 class MergedIndex {
 private:
     struct Impl;
 
     using Self = MergedIndex;
 
-    MergedIndex(std::unique_ptr<llvm::MemoryBuffer> buffer, std::unique_ptr<Impl> impl);
+    MergedIndex(std::shared_ptr<llvm::MemoryBuffer> buffer, std::unique_ptr<Impl> impl);
 
+    /// Load the contexts and canonical ids from the base, which is enough for
+    /// modification. Occurrences and relations stay in the base. If the delta
+    /// is shared with snapshots, it is copied first.
+    void load_metadata(this Self& self);
+
+    /// Fold the whole base into memory.
     void load_in_memory(this Self& self);
 
 public:
@@ -31,8 +67,10 @@ public:
 
     ~MergedIndex();
 
-    /// Load merged index from disk
-    static MergedIndex load(llvm::StringRef path);
+    /// Load merged index from disk. The file is memory mapped rather than read
+    /// into heap, so only the pages touched by lookups become resident. If
+    /// `populate` is true, ask the kernel to prefault the whole file eagerly.
+    static MergedIndex load(llvm::StringRef path, bool populate = false);
 
     /// Serialize it to binary format.
     void serialize(this const Self& self, llvm::raw_ostream& out);
@@ -48,36 +86,122 @@ public:
                 RelationKind kind,
                 llvm::function_ref<bool(const Relation&)> callback);
 
-    /// Whether this index needs rebuilding.
-    bool need_update(this const Self& self, llvm::ArrayRef<llvm::StringRef> path_mapping);
-
-    bool need_rewrite() {
-        return impl != nullptr;
+    /// Lookup the relations of given kind whose target is the symbol, together
+    /// with their source symbols. Only the relations between symbols, e.g. calls
+    /// and bases, have targets.
+    void reverse_lookup(this const Self& self,
+                        SymbolHash target,
+                        RelationKind kind,
+                        llvm::function_ref<bool(SymbolHash, const Relation&)> callback);
+
+    /// Call `callback` with the path id of every source file which includes this
+    /// file, i.e. provides a header context of it.
+    void includers(this const Self& self, llvm::function_ref<void(std::uint32_t)> callback);
+
+    /// The line table of the latest indexed content, empty if unknown. It is
+    /// valid until next modification of this index.
+    LineTableRef lines(this const Self& self);
+
+    /// Whether this index needs rebuilding, i.e. the source file or any file it
+    /// includes is modified after it was built. `modified_time` returns the last
+    /// modification time (in milliseconds) of the file with given path id, or
+    /// nullopt if the file doesn't exist. If `content_hash` is given, a file
+    /// modified after building is only considered changed if its content hash
+    /// differs from the one when building.
+    bool need_update(
+        this const Self& self,
+        llvm::function_ref<std::optional<std::int64_t>(std::uint32_t)> modified_time,
+        llvm::function_ref<std::optional<std::uint64_t>(std::uint32_t)> content_hash = nullptr);
+
+    /// Whether this index was modified after it was loaded.
+    bool need_rewrite() const {
+        return dirty;
     }
 
+    /// Mark this index as written to disk, `written` is the index itself or its
+    /// snapshot which was written. Return false if this index was modified after
+    /// the snapshot was taken, it still needs rewriting then.
+    bool mark_written(this Self& self, const MergedIndex& written);
+
+    /// An estimation of the memory (in bytes) held by this index, including
+    /// the mapped file and the in memory data.
+    std::size_t memory_usage(this const Self& self);
+
+    /// Whether the in memory delta grows large enough to be folded into base,
+    /// or there are too many dead canonical ids.
+    bool need_compact(this const Self& self);
+
+    /// Take a snapshot which shares the immutable base and the delta with this
+    /// index, so it could be looked up or compacted in another thread. The
+    /// delta is copied on next modification of either of them.
+    MergedIndex snapshot(this const Self& self);
+
+    /// Fold the in memory delta into a new immutable base. Canonical ids which
+    /// are no longer referenced are dropped along with their occurrences and
+    /// relations, and the rest are renumbered densely.
+    CompactStatistics compact(this Self& self);
+
+    /// Replace the content with a compacted snapshot of this index. Return false
+    /// if this index was modified after the snapshot was taken.
+    bool rebase(this Self& self, MergedIndex&& compacted);
+
     /// Remove the index of specific path id.
     void remove(this Self& self, std::uint32_t path_id);
 
-    /// Merge the index with given compilation context.
+    /// Merge the index with given compilation context. `dependencies` are the
+    /// content hashes of the source file and all files it includes.
     void merge(this Self& self,
                std::uint32_t path_id,
                std::chrono::milliseconds build_at,
                std::vector<IncludeLocation> include_locations,
-               FileIndex& index);
+               FileIndex& index,
+               std::vector<DependencyHash> dependencies = {});
+
+    /// Merge the index with given header context, return the hash of the index.
+    IndexHash merge(this Self& self,
+                    std::uint32_t path_id,
+                    std::uint32_t include_id,
+                    FileIndex& index);
+
+    /// A header context pending to be merged.
+    struct PendingHeader {
+        std::uint32_t path_id;
 
-    /// Merge the index with given header context.
-    void merge(this Self& self, std::uint32_t path_id, std::uint32_t include_id, FileIndex& index);
+        std::uint32_t include_id;
+
+        FileIndex* index;
+    };
+
+    /// Merge multiple header contexts at once, it is faster than merging them
+    /// one by one. Return the hashes of their indices in the same order.
+    llvm::SmallVector<IndexHash> merge_batch(this Self& self,
+                                             llvm::ArrayRef<PendingHeader> headers);
+
+    /// Add a header context whose index with the hash was merged before, without
+    /// the index itself. Return false if the index is unknown, e.g. it has been
+    /// dropped by compaction.
+    bool merge(this Self& self,
+               std::uint32_t path_id,
+               std::uint32_t include_id,
+               const IndexHash& hash);
 
     friend bool operator== (MergedIndex& lhs, MergedIndex& rhs);
 
 private:
     /// The binary serialization data of index. If you load merged index
-    /// from disk, we use directly access the data without deserialization
-    /// unless you want to modify it.
-    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    /// from disk, we use directly access the data without deserialization.
+    /// It is immutable and shared with snapshots.
+    std::shared_ptr<llvm::MemoryBuffer> buffer;
+
+    /// The in memory metadata and the delta merged over the buffer. It is shared
+    /// with snapshots and never modified while shared.
+    std::shared_ptr<Impl> impl;
+
+    /// Whether the index was modified after it was loaded.
+    bool dirty = false;
 
-    /// The in memory data of the index.
-    std::unique_ptr<Impl> impl;
+    /// The version of last modification, 0 if never modified.
+    std::uint64_t version = 0;
 };
 
 }  // namespace clice::index
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <memory>
+#include "TUIndex.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace clice::index {
+
+/// An index from names to symbols, which answers fuzzy queries. Every name is
+/// split into trigrams, each of them has a posting list of the names containing
+/// it. A query only scores the names containing all of its trigrams. It could
+/// be used from multiple threads concurrently.
+class NameIndex {
+public:
+    NameIndex();
+
+    NameIndex(NameIndex&&);
+
+    NameIndex& operator= (NameIndex&&);
+
+    ~NameIndex();
+
+    /// Add the symbols with their names, the symbols already added are skipped.
+    void insert(llvm::ArrayRef<std::pair<SymbolHash, llvm::StringRef>> symbols);
+
+    /// Search the symbols whose names fuzzy match the query, at most `limit`
+    /// symbols are reported in descending order of the score. An empty query
+    /// matches all names.
+    void search(llvm::StringRef query,
+                std::size_t limit,
+                llvm::function_ref<void(SymbolHash, llvm::StringRef, float)> callback) const;
+
+    /// Get the name of the symbol, empty if it is unknown. The name is valid
+    /// as long as the index.
+    llvm::StringRef name(SymbolHash symbol) const;
+
+    /// The count of distinct names.
+    std::size_t size() const;
+
+    /// Serialize the index, names are written in sorted order.
+    void serialize(llvm::raw_ostream& os) const;
+
+    static NameIndex from(const void* data);
+
+private:
+    struct Impl;
+
+    std::unique_ptr<Impl> impl;
+};
+
+}  // namespace clice::index
@@ -1,39 +1,174 @@
 #pragma once
 
+#include <bit>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <expected>
+#include <optional>
 #include "TUIndex.h"
+#include "NameIndex.h"
+#include "llvm/ADT/FunctionExtras.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 namespace clice::index {
 
-struct PathPool {
-    llvm::BumpPtrAllocator allocator;
+/// A pool which maps paths to dense ids. It could be used from multiple threads
+/// concurrently, the paths are sharded by their hash and each shard has its own
+/// lock. Resolving an id to its path never takes a lock.
+class PathPool {
+public:
+    PathPool();
 
-    std::vector<llvm::StringRef> paths;
+    PathPool(PathPool&&) = default;
 
-    llvm::DenseMap<llvm::StringRef, std::uint32_t> cache;
+    PathPool& operator= (PathPool&&) = default;
 
-    llvm::StringRef save(llvm::StringRef s) {
-        auto data = allocator.Allocate<char>(s.size() + 1);
-        std::ranges::copy(s, data);
-        data[s.size()] = '\0';
-        return llvm::StringRef(data, s.size());
-    }
+    ~PathPool();
+
+    /// Get the id of the path, allocate a new one if it is not in the pool.
+    std::uint32_t path_id(llvm::StringRef path);
 
-    auto path_id(llvm::StringRef path) {
-        assert(!path.empty());
-        auto [it, success] = cache.try_emplace(path, paths.size());
-        if(!success) {
-            return it->second;
-        }
-
-        auto& [k, v] = *it;
-        k = save(path);
-        paths.emplace_back(k);
-        return it->second;
+    /// Get the path of the id. The id must be returned by `path_id` before.
+    llvm::StringRef path(std::uint32_t id) const;
+
+    /// The count of allocated ids. Paths whose ids are being allocated by other
+    /// threads may be still empty.
+    std::uint32_t size() const {
+        return next_id->load(std::memory_order_acquire);
     }
 
-    llvm::StringRef path(std::uint32_t id) {
-        return paths[id];
+private:
+    friend struct ProjectIndex;
+
+    /// Insert the path with given id, only used when loading. The path isn't
+    /// copied, it must outlive the pool.
+    void insert(std::uint32_t id, llvm::StringRef path);
+
+    /// Publish the path to the id, allocate the segment if necessary.
+    void publish(std::uint32_t id, const llvm::StringRef* path);
+
+    struct Shard {
+        std::mutex mutex;
+
+        llvm::BumpPtrAllocator allocator;
+
+        llvm::DenseMap<llvm::StringRef, std::uint32_t> cache;
+    };
+
+    constexpr static std::size_t ShardCount = 64;
+
+    /// The id to path table is split into segments whose sizes grow geometrically,
+    /// so it could grow without moving the published slots.
+    constexpr static std::size_t FirstSegmentSize = 1024;
+
+    constexpr static std::size_t SegmentCount = 23;
+
+    using Slot = std::atomic<const llvm::StringRef*>;
+
+    std::unique_ptr<Shard[]> shards;
+
+    std::unique_ptr<std::atomic<Slot*>[]> segments;
+
+    std::unique_ptr<std::atomic<std::uint32_t>> next_id;
+};
+
+/// A symbol table split into shards by the symbol hash, each shard is guarded
+/// by its own lock so that multiple threads could merge into it concurrently.
+class ShardedSymbolTable {
+public:
+    /// Decode the symbol at given position of the loaded symbols.
+    using Decoder = llvm::unique_function<Symbol(std::size_t) const>;
+
+    ShardedSymbolTable();
+
+    /// Set the symbols loaded from a file, `ids` are in ascending order and
+    /// `decoder` decodes the symbol at the same position. A symbol is decoded
+    /// on its first access, the ids must outlive the table.
+    void load(llvm::ArrayRef<SymbolHash> ids, Decoder decoder);
+
+    /// Call `callback` with the symbol of the id, insert an empty one if absent.
+    /// The shard of the symbol is locked during the call.
+    void update(SymbolHash id, llvm::function_ref<void(Symbol&)> callback);
+
+    /// Merge all symbols of the table, `callback` merges the source symbol into
+    /// the target one. Every shard is locked once for all its symbols.
+    void merge(
+        const SymbolTable& symbols,
+        llvm::function_ref<void(SymbolHash, Symbol& target, const Symbol& source)> callback);
+
+    /// Call `callback` with the symbol of the id if it exists. The shard of the
+    /// symbol is locked during the call.
+    bool lookup(SymbolHash id, llvm::function_ref<void(const Symbol&)> callback) const;
+
+    /// Call `callback` with every symbol, shards are locked one by one.
+    void for_each(llvm::function_ref<void(SymbolHash, const Symbol&)> callback) const;
+
+    std::size_t size() const;
+
+private:
+    struct Shard {
+        mutable std::mutex mutex;
+
+        SymbolTable symbols;
+
+        /// The ids of the loaded symbols in this shard, sorted. The shards are
+        /// split by the high bits of ids, so they are a slice of all loaded ids.
+        llvm::ArrayRef<SymbolHash> loaded;
+
+        /// The position of the first id of `loaded` in all loaded ids.
+        std::size_t loaded_offset = 0;
+
+        /// The count of loaded symbols which have been decoded into `symbols`.
+        std::size_t decoded = 0;
+    };
+
+    constexpr static std::size_t ShardCount = 64;
+
+    constexpr static std::size_t ShardShift = 64 - std::countr_zero(ShardCount);
+
+    static std::size_t shard_of(SymbolHash id) {
+        /// The low bits are used by the hash table in the shard, take the high bits.
+        return id >> ShardShift;
     }
+
+    /// Find the symbol in the locked shard, decode it if it is loaded but not
+    /// decoded yet. Return nullptr if it doesn't exist.
+    Symbol* find(Shard& shard, SymbolHash id) const;
+
+    std::unique_ptr<Shard[]> shards;
+
+    Decoder decoder;
+};
+
+/// The hashes of the header indices known to the project, keyed by the
+/// fingerprints of their header contexts, see `TUIndex::build`. It could be
+/// used from multiple threads concurrently.
+class HeaderCache {
+public:
+    HeaderCache();
+
+    bool contains(std::uint64_t fingerprint) const;
+
+    /// Get the hash of the header index with the fingerprint, if it is known.
+    std::optional<IndexHash> lookup(std::uint64_t fingerprint) const;
+
+    void insert(std::uint64_t fingerprint, const IndexHash& hash);
+
+    void erase(std::uint64_t fingerprint);
+
+    /// Call `callback` with every entry, the cache is locked during the calls.
+    void for_each(llvm::function_ref<void(std::uint64_t, const IndexHash&)> callback) const;
+
+private:
+    struct State {
+        mutable std::mutex mutex;
+
+        llvm::DenseMap<std::uint64_t, IndexHash> hashes;
+    };
+
+    std::unique_ptr<State> state;
 };
 
 struct FileInfo {
@@ -43,15 +178,47 @@ struct FileInfo {
 struct ProjectIndex {
     PathPool path_pool;
 
+    /// Only accessed from the main thread.
     llvm::DenseMap<std::uint32_t, std::uint32_t> indices;
 
-    SymbolTable symbols;
+    ShardedSymbolTable symbols;
+
+    /// The header indices already merged, so that the same header contexts in
+    /// other translation units could skip indexing.
+    HeaderCache headers;
 
+    /// Merge the symbols of the translation unit and return the map from its
+    /// path ids to the path ids in the project. It is thread-safe.
     llvm::SmallVector<std::uint32_t> merge(this ProjectIndex& self, TUIndex& index);
 
+    /// The names of all symbols, for fuzzy search. They are decoded from the
+    /// loaded file on first access, it is thread-safe.
+    NameIndex& names(this ProjectIndex& self);
+
     void serialize(this ProjectIndex& self, llvm::raw_ostream& os);
 
+    /// Load the project index from the serialized data without copying it, the
+    /// data must outlive the index. Symbols and names are decoded lazily.
     static ProjectIndex from(const void* data);
+
+    /// Map the project index file and verify it, return the error if it is
+    /// missing or corrupted.
+    static std::expected<ProjectIndex, std::string> load(llvm::StringRef path);
+
+private:
+    struct LazyNames {
+        std::once_flag flag;
+
+        /// The serialized name index to decode, null if there isn't one.
+        const void* data = nullptr;
+
+        NameIndex index;
+    };
+
+    std::unique_ptr<LazyNames> lazy_names = std::make_unique<LazyNames>();
+
+    /// The mapped file, if the index is loaded from disk.
+    std::shared_ptr<llvm::MemoryBuffer> buffer;
 };
 
 }  // namespace clice::index
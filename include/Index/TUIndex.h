@@ -1,17 +1,28 @@
 #pragma once
 
 #include <chrono>
+#include "LineTable.h"
 #include "IncludeGraph.h"
 #include "AST/SourceCode.h"
 #include "AST/SymbolKind.h"
 #include "AST/RelationKind.h"
 #include "Support/Bitmap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
 
 namespace clice::index {
 
 using Range = LocalSourceRange;
 using SymbolHash = std::uint64_t;
 
+/// The 128-bit content hash of a file index, same indices have the same hash.
+struct IndexHash {
+    std::uint64_t low;
+    std::uint64_t high;
+
+    friend bool operator== (const IndexHash&, const IndexHash&) = default;
+};
+
 struct Relation {
     RelationKind kind;
 
@@ -45,7 +56,25 @@ struct FileIndex {
 
     std::vector<Occurrence> occurrences;
 
-    std::array<std::uint8_t, 32> hash();
+    /// The line table of the content when it was indexed.
+    LineTable lines;
+
+    IndexHash hash();
+
+    /// Lookup the occurrences containing the offset, the occurrences must be
+    /// sorted as built.
+    void lookup(std::uint32_t offset, llvm::function_ref<bool(const Occurrence&)> callback) const;
+
+    /// Lookup the relations of given symbol.
+    void lookup(SymbolHash symbol,
+                RelationKind kind,
+                llvm::function_ref<bool(const Relation&)> callback) const;
+
+    /// Lookup the relations of given kind whose target is the symbol, together
+    /// with their source symbols.
+    void reverse_lookup(SymbolHash target,
+                        RelationKind kind,
+                        llvm::function_ref<bool(SymbolHash, const Relation&)> callback) const;
 };
 
 struct Symbol {
@@ -74,7 +103,29 @@ struct TUIndex {
 
     FileIndex main_file_index;
 
-    static TUIndex build(CompilationUnit& unit);
+    /// The hashes of the content of files, parallel to `graph.paths`.
+    std::vector<std::uint64_t> content_hashes;
+
+    /// The fingerprints of header contexts, only computed if `is_known` is given
+    /// when building.
+    llvm::DenseMap<clang::FileID, std::uint64_t> fingerprints;
+
+    /// The header contexts skipped for their fingerprints are known, they have
+    /// no file indices.
+    llvm::DenseSet<clang::FileID> skipped_files;
+
+    /// Build the index of the unit. A header context is neither visited nor
+    /// indexed if `is_known` returns true for its fingerprint, which covers the
+    /// path and content of the header, the values of its conditional directives
+    /// and the definitions of the macros it expands.
+    static TUIndex build(CompilationUnit& unit,
+                         llvm::function_ref<bool(std::uint64_t)> is_known = nullptr);
+
+    /// Build the index of the main file only, from the top level declarations
+    /// collected when building the unit, e.g. the AST of an opened file. The
+    /// declarations in headers and preamble are not visited, and the hashes of
+    /// files are not computed.
+    static TUIndex build_main_file(CompilationUnit& unit);
 };
 
 }  // namespace clice::index
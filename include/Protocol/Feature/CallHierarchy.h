@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../Basic.h"
+#include "DocumentSymbol.h"
 
 namespace clice::proto {
 
@@ -8,4 +9,55 @@ struct CallHierarchyClientCapabilities {};
 
 using CallHierarchyOptions = WorkDoneProgressOptions;
 
+using CallHierarchyPrepareParams = TextDocumentPositionParams;
+
+struct CallHierarchyItem {
+    /// The name of this item.
+    string name;
+
+    /// The kind of this item.
+    SymbolKind kind;
+
+    /// The resource identifier of this item.
+    DocumentUri uri;
+
+    /// The range enclosing this symbol not including leading/trailing whitespace
+    /// but everything else, e.g. comments and code.
+    Range range;
+
+    /// The range that should be selected and revealed when this symbol is being
+    /// picked, e.g. the name of a function. Must be contained by the `range`.
+    Range selectionRange;
+
+    /// A data entry field that is preserved between a call hierarchy prepare and
+    /// incoming calls or outgoing calls requests. It is the symbol id here.
+    string data;
+};
+
+struct CallHierarchyIncomingCallsParams {
+    CallHierarchyItem item;
+};
+
+struct CallHierarchyIncomingCall {
+    /// The item that makes the call.
+    CallHierarchyItem from;
+
+    /// The ranges at which the calls appear. This is relative to the caller
+    /// denoted by `from`.
+    array<Range> fromRanges;
+};
+
+struct CallHierarchyOutgoingCallsParams {
+    CallHierarchyItem item;
+};
+
+struct CallHierarchyOutgoingCall {
+    /// The item that is called.
+    CallHierarchyItem to;
+
+    /// The range at which this item is called. This is the range relative to
+    /// the caller, e.g the item passed to `callHierarchy/outgoingCalls` request.
+    array<Range> fromRanges;
+};
+
 }  // namespace clice::proto
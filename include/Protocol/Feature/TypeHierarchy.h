@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../Basic.h"
+#include "CallHierarchy.h"
 
 namespace clice::proto {
 
@@ -8,4 +9,19 @@ struct TypeHierarchyClientCapabilities {};
 
 using TypeHierarchyOptions = WorkDoneProgressOptions;
 
+using TypeHierarchyPrepareParams = TextDocumentPositionParams;
+
+/// The type hierarchy item has the same fields as the call hierarchy item, the
+/// `data` is preserved between a type hierarchy prepare and supertypes or
+/// subtypes requests.
+using TypeHierarchyItem = CallHierarchyItem;
+
+struct TypeHierarchySupertypesParams {
+    TypeHierarchyItem item;
+};
+
+struct TypeHierarchySubtypesParams {
+    TypeHierarchyItem item;
+};
+
 }  // namespace clice::proto
@@ -155,7 +155,7 @@ struct ServerCapabilities {
     /// FIXME: LinkedEditingRangeOptions linkedEditingRangeProvider;
 
     /// The server provides call hierarchy support.
-    /// FIXME: CallHierarchyOptions callHierarchyProvider;
+    CallHierarchyOptions callHierarchyProvider;
 
     /// The server provides semantic tokens support.
     SemanticTokensOptions semanticTokensProvider;
@@ -164,7 +164,7 @@ struct ServerCapabilities {
     /// FIXME: MonikerOptions monikerProvider;
 
     /// The server provides type hierarchy support.
-    /// FIXME: TypeHierarchyOptions typeHierarchyProvider;
+    TypeHierarchyOptions typeHierarchyProvider;
 
     /// The server provides inline values.
     /// FIXME: InlineValueOptions inlineValueProvider;
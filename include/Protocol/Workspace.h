@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Basic.h"
+#include "Feature/DocumentSymbol.h"
 
 namespace clice::proto {
 
@@ -17,6 +18,25 @@ struct WorkspaceClientCapabilities {};
 
 struct WorkspaceSymbolOptions {};
 
+struct WorkspaceSymbolParams {
+    /// A query string to filter symbols by. Clients may send an empty
+    /// string here to request all symbols.
+    string query;
+};
+
+/// Represents information about programming constructs like variables, classes,
+/// interfaces etc.
+struct SymbolInformation {
+    /// The name of this symbol.
+    string name;
+
+    /// The kind of this symbol.
+    SymbolKind kind;
+
+    /// The location of this symbol.
+    Location location;
+};
+
 struct WorkspaceFoldersServerCapabilities {
     /// The server has support for workspace folders.
     bool supported = true;
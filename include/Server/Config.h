@@ -15,6 +15,26 @@ struct ProjectOptions {
 
     std::size_t max_active_file = 8;
 
+    /// The memory budget (in MiB) of merged indices kept in memory.
+    std::size_t max_index_memory = 1024;
+
+    /// The interval (in seconds) of writing modified indices back to disk, 0 to
+    /// write them only before exiting.
+    std::size_t index_flush_interval = 60;
+
+    /// Compare the content of files modified after they were indexed, so that
+    /// files touched without changing, e.g. by switching branches, are not
+    /// indexed again.
+    bool compare_content = true;
+
+    /// The count of files indexed concurrently at most, 0 to decide it by the
+    /// count of cores.
+    std::size_t max_index_jobs = 0;
+
+    /// The memory (in MiB) kept free when indexing, fewer files are indexed
+    /// concurrently if the available memory of the system is less.
+    std::size_t index_memory_headroom = 2048;
+
     std::string cache_dir = "${workspace}/.clice/cache";
 
     std::string index_dir = "${workspace}/.clice/index";
@@ -1,6 +1,8 @@
 #pragma once
 
-#include <deque>
+#include <array>
+#include <atomic>
+#include <list>
 #include <vector>
 
 #include "Config.h"
@@ -15,47 +17,393 @@
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/FunctionExtras.h"
+#include "llvm/Support/Chrono.h"
 
 namespace clice {
 
 class CompilationUnit;
 
+/// A byte budgeted LRU cache for merged indices. Indices that need rewriting
+/// are handed to the flusher before eviction, so evicting never loses data.
+class MergedIndexCache {
+public:
+    /// Take a dirty index evicted from the cache, to write it back.
+    using Flusher = llvm::unique_function<void(std::uint32_t, index::MergedIndex)>;
+
+    struct Entry {
+        std::uint32_t path_id;
+
+        /// The memory usage of the index when it was accounted last time.
+        std::size_t bytes = 0;
+
+        index::MergedIndex index;
+    };
+
+    /// A double-linked list of all cached indices, the first element is the
+    /// most recently used.
+    using ListContainer = std::list<Entry>;
+
+    struct Statistics {
+        std::size_t hits = 0;
+
+        std::size_t misses = 0;
+
+        std::size_t evictions = 0;
+
+        /// The count of dirty indices handed to the flusher on eviction.
+        std::size_t flushes = 0;
+    };
+
+    constexpr static std::size_t DefaultCapacity = std::size_t(1024) * 1024 * 1024;
+
+public:
+    MergedIndexCache() = default;
+
+    MergedIndexCache(const MergedIndexCache&) = delete;
+
+    MergedIndexCache& operator= (const MergedIndexCache&) = delete;
+
+    /// Set the memory budget in bytes, at least one index is always kept.
+    void set_capacity(std::size_t bytes) {
+        capacity = bytes;
+        evict();
+    }
+
+    void set_flusher(Flusher flusher) {
+        this->flusher = std::move(flusher);
+    }
+
+    std::size_t max_size() const {
+        return capacity;
+    }
+
+    /// The number of cached indices.
+    std::size_t size() const {
+        return table.size();
+    }
+
+    /// The accounted memory usage of all cached indices.
+    std::size_t memory_usage() const {
+        return used;
+    }
+
+    const Statistics& statistics() const {
+        return stats;
+    }
+
+    bool contains(std::uint32_t path_id) const {
+        return table.contains(path_id);
+    }
+
+    /// Get the cached index without marking it as recently used. Return nullptr
+    /// if it is not cached. The returned index must not be modified.
+    index::MergedIndex* peek(std::uint32_t path_id) {
+        auto it = table.find(path_id);
+        return it == table.end() ? nullptr : &it->second->index;
+    }
+
+    /// Get the cached index and mark it as most recently used. Return nullptr
+    /// if it is not cached. The returned index is valid until next call of
+    /// `get` or `add`.
+    index::MergedIndex* get(std::uint32_t path_id);
+
+    /// Add an index to the cache and evict least recently used indices if the
+    /// budget is exceeded. The returned index is valid until next call of
+    /// `get` or `add`.
+    index::MergedIndex& add(std::uint32_t path_id, index::MergedIndex index);
+
+    auto begin() {
+        return items.begin();
+    }
+
+    auto end() {
+        return items.end();
+    }
+
+private:
+    /// Indices are mutated by the caller after being returned, update the
+    /// accounting of the most recently used one before making any decision.
+    void refresh();
+
+    void evict();
+
+private:
+    std::size_t capacity = DefaultCapacity;
+
+    std::size_t used = 0;
+
+    ListContainer items;
+
+    llvm::DenseMap<std::uint32_t, ListContainer::iterator> table;
+
+    Statistics stats;
+
+    Flusher flusher;
+};
+
+/// A cache of the modification times and content hashes of files, so that
+/// checking whether the indices are up to date stats a header once instead of
+/// once per unit which includes it. An entry expires after the TTL, or when the
+/// file is known to be changed.
+class FileStatusCache {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    constexpr static std::chrono::milliseconds DefaultTTL = std::chrono::seconds(10);
+
+    void set_ttl(std::chrono::milliseconds ttl) {
+        this->ttl = ttl;
+    }
+
+    /// Get the last modification time (in milliseconds) of the file, nullopt if
+    /// it doesn't exist. The file is only stat'ed if its entry expires.
+    std::optional<std::int64_t> modified_time(std::uint32_t path_id, llvm::StringRef path);
+
+    /// Get the hash of the file content, nullopt if it can't be read. The file is
+    /// only read again if it is modified since last reading.
+    std::optional<std::uint64_t> content_hash(std::uint32_t path_id, llvm::StringRef path);
+
+    void invalidate(std::uint32_t path_id) {
+        entries.erase(path_id);
+    }
+
+    void clear() {
+        entries.clear();
+    }
+
+    /// The count of stat calls.
+    std::size_t stats() const {
+        return stat_count;
+    }
+
+private:
+    struct Entry {
+        std::optional<std::int64_t> time;
+
+        Clock::time_point checked_at;
+
+        std::optional<std::uint64_t> hash;
+
+        /// The modification time when the hash was computed.
+        std::optional<std::int64_t> hashed_time;
+    };
+
+    std::chrono::milliseconds ttl = DefaultTTL;
+
+    llvm::DenseMap<std::uint32_t, Entry> entries;
+
+    std::size_t stat_count = 0;
+};
+
+/// The files waiting to be indexed. The file with the highest priority is
+/// popped first, and files with the same priority are popped in the order they
+/// are pushed. A file is pending at most once.
+class IndexQueue {
+public:
+    enum class Priority : std::uint8_t {
+        /// Files in system or third-party directories.
+        Low,
+
+        Normal,
+
+        /// Open or recently saved files, and the files including them.
+        High,
+    };
+
+    /// Push the file. If it is already pending, raise its priority if the new
+    /// one is higher, otherwise keep its position.
+    void push(std::uint32_t path_id, Priority priority);
+
+    /// Pop the file with the highest priority, the queue must not be empty.
+    std::pair<std::uint32_t, Priority> pop();
+
+    /// The highest priority of pending files, the queue must not be empty.
+    Priority top_priority();
+
+    bool contains(std::uint32_t path_id) const {
+        return pending.contains(path_id);
+    }
+
+    bool empty() const {
+        return pending.empty();
+    }
+
+    std::size_t size() const {
+        return pending.size();
+    }
+
+    /// The count of pending files with given priority.
+    std::size_t count(Priority priority) const {
+        return counts[std::to_underlying(priority)];
+    }
+
+private:
+    struct Item {
+        Priority priority;
+
+        /// The order of pushing, a smaller one is popped first.
+        std::uint64_t sequence;
+
+        std::uint32_t path_id;
+    };
+
+    /// Drop the items at the top of heap which are replaced by raising.
+    void discard_stale();
+
+    /// A max heap of items. A raised file leaves its old item in the heap, which
+    /// is skipped when it reaches the top.
+    std::vector<Item> heap;
+
+    /// The latest item of every pending file.
+    llvm::DenseMap<std::uint32_t, Item> pending;
+
+    std::uint64_t next_sequence = 0;
+
+    /// The count of pending files of each priority.
+    std::array<std::size_t, 3> counts = {};
+};
+
+/// Decide how many files could be indexed concurrently. Every job compiles a
+/// whole unit, so jobs are only admitted if the available memory of the system
+/// could hold their peaks, which are estimated from the recent jobs.
+class IndexAdmission {
+public:
+    /// The peak memory assumed for a job before any job finishes.
+    constexpr static std::size_t DefaultJobMemory = std::size_t(512) * 1024 * 1024;
+
+    /// The count of recent jobs whose peaks are kept.
+    constexpr static std::size_t HistorySize = 16;
+
+    /// Set the count of jobs allowed when there is enough memory, at least one.
+    void set_max_jobs(std::size_t count) {
+        max_jobs = std::max<std::size_t>(count, 1);
+    }
+
+    /// Set the memory (in bytes) kept free for the other parts of the server and
+    /// the other processes.
+    void set_headroom(std::size_t bytes) {
+        headroom = bytes;
+    }
+
+    std::size_t max_size() const {
+        return max_jobs;
+    }
+
+    /// Record the peak memory of a finished job.
+    void record(std::size_t bytes) {
+        peaks[recorded % HistorySize] = bytes;
+        recorded += 1;
+    }
+
+    /// The estimated peak memory of next job, the largest one of recent jobs.
+    std::size_t job_memory() const;
+
+    /// The count of jobs allowed to run concurrently. `available` is the available
+    /// memory of the system, nullopt if unknown. `settled` is the count of jobs
+    /// started before it was sampled, they are assumed to have allocated half of
+    /// their peaks. While interactive requests are in flight, only half of the
+    /// jobs are allowed. At least one job is always allowed.
+    std::size_t capacity(std::optional<std::size_t> available,
+                         std::size_t settled,
+                         std::size_t interactive) const;
+
+    /// The count of running jobs to stop for the `urgent` files waiting beyond
+    /// the capacity, at most `preemptible`. `stopping` jobs are stopped already
+    /// and leave room once they return.
+    static std::size_t preemptions(std::size_t urgent,
+                                   std::size_t stopping,
+                                   std::size_t preemptible) {
+        return urgent > stopping ? std::min(urgent - stopping, preemptible) : 0;
+    }
+
+private:
+    std::size_t max_jobs = 1;
+
+    std::size_t headroom = 0;
+
+    /// The peaks of recent jobs, a ring buffer indexed by `recorded`.
+    std::array<std::size_t, HistorySize> peaks = {};
+
+    std::size_t recorded = 0;
+};
+
 class Indexer {
 public:
     Indexer(CompilationDatabase& database,
             config::Config& config,
             const PositionEncodingKind& kind) :
-        database(database), config(config), encoding_kind(kind) {}
+        database(database), config(config), encoding_kind(kind) {
+        in_memory_indices.set_flusher([this](std::uint32_t path_id, index::MergedIndex index) {
+            evicted_indices.insert_or_assign(path_id, std::move(index));
+            request_flush();
+        });
+    }
 
     async::Task<> index(llvm::StringRef path);
 
-    async::Task<> index(llvm::StringRef path, llvm::StringRef content);
-
-    async::Task<> schedule_next();
+    /// Index the main file of the AST built for an opened file in background.
+    /// The index reflects the unsaved content, and is used for lookups in the
+    /// file instead of its merged index until the file is closed. The indexing
+    /// of an older AST of the file is cancelled.
+    void index(llvm::StringRef path, std::shared_ptr<CompilationUnit> unit);
 
     async::Task<> index_all();
 
-    index::MergedIndex& get_index(std::uint32_t path_id) {
-        auto [it, success] = in_memory_indices.try_emplace(path_id);
-        if(!success) {
-            return it->second;
-        }
-
-        auto it2 = project_index.indices.find(path_id);
-        if(it2 != project_index.indices.end()) {
-            auto path = project_index.path_pool.path(it2->second);
-            it->second = index::MergedIndex::load(path);
-        }
+    /// Schedule the file to be indexed in background.
+    void schedule(std::uint32_t path_id, IndexQueue::Priority priority);
 
-        return it->second;
-    }
+    /// Get the merged index of given file, load it from disk if it is not in
+    /// memory. The reference may be invalidated by next call.
+    index::MergedIndex& get_index(std::uint32_t path_id);
 
     using Result = async::Task<std::vector<proto::Location>>;
 
     void load_from_disk();
 
+    /// Called when the file is known to be changed, e.g. saved. It and the files
+    /// including it are indexed first.
+    void file_changed(llvm::StringRef path);
+
+    /// Called when the file is opened. It or the files including it are indexed
+    /// first.
+    void file_opened(llvm::StringRef path);
+
+    /// Called when the file is closed, its dynamic index is dropped.
+    void file_closed(llvm::StringRef path);
+
+    /// Called when the content of an opened file is edited. The running job of
+    /// it is aborted, it is indexed again after the other files, or earlier once
+    /// it is saved.
+    void file_edited(llvm::StringRef path);
+
+    /// Called when an interactive request starts or finishes, background indexing
+    /// backs off while any of them is in flight.
+    void request_started() {
+        interactive_requests += 1;
+    }
+
+    void request_finished() {
+        interactive_requests -= 1;
+        if(interactive_requests == 0) {
+            dispatch();
+        }
+    }
+
+    /// Write all modified indices and the project index to disk, it blocks
+    /// until everything is written. Used before exiting.
     void save_to_disk();
 
+    /// Write the modified indices to disk in background, in batches, and then
+    /// save the project index. Only one flush runs at a time.
+    async::Task<> flush();
+
+    const MergedIndexCache::Statistics& cache_statistics() const {
+        return in_memory_indices.statistics();
+    }
+
+    /// Lookup the locations related to the symbol at given offset. References
+    /// in different files are resolved in the thread pool concurrently.
     auto lookup(llvm::StringRef path, std::uint32_t offset, RelationKind kind) -> Result;
 
     auto declaration(llvm::StringRef path, std::uint32_t offset) -> Result;
@@ -64,9 +412,190 @@ public:
 
     auto references(llvm::StringRef path, std::uint32_t offset) -> Result;
 
-    /// TODO: Calls ...
+    /// The count of symbols reported by a workspace symbol search at most.
+    constexpr static std::size_t max_workspace_symbols = 100;
+
+    /// Search the symbols in the project whose names fuzzy match the query,
+    /// ordered by the score of the match.
+    auto symbols(llvm::StringRef query) -> async::Task<std::vector<proto::SymbolInformation>>;
+
+    /// Get the call or type hierarchy item of the symbol at given offset.
+    auto prepare_hierarchy(llvm::StringRef path, std::uint32_t offset)
+        -> async::Task<std::vector<proto::CallHierarchyItem>>;
+
+    /// The callers of the item, with the ranges of calls in the callers.
+    auto incoming_calls(const proto::CallHierarchyItem& item)
+        -> async::Task<std::vector<proto::CallHierarchyIncomingCall>>;
+
+    /// The callees of the item, with the ranges of calls in the item.
+    auto outgoing_calls(const proto::CallHierarchyItem& item)
+        -> async::Task<std::vector<proto::CallHierarchyOutgoingCall>>;
+
+    /// The direct bases of the item.
+    auto supertypes(const proto::TypeHierarchyItem& item)
+        -> async::Task<std::vector<proto::TypeHierarchyItem>>;
+
+    /// The direct derived classes of the item.
+    auto subtypes(const proto::TypeHierarchyItem& item)
+        -> async::Task<std::vector<proto::TypeHierarchyItem>>;
+
+private:
+    /// Compile the source file and merge its index. If `skip_known` is true, the
+    /// header contexts known to the project are not indexed again. Return false
+    /// if any of them was dropped from its merged index meanwhile, then it has
+    /// to be indexed again without skipping.
+    async::Task<bool> index(llvm::StringRef path, std::uint32_t path_id, bool skip_known);
+
+    /// The path of the index file of given file.
+    std::string index_path(std::uint32_t path_id);
+
+    /// Write the merged index of given file to the index directory.
+    bool write_index(std::uint32_t path_id, index::MergedIndex& index);
+
+    /// Record the index files written after the project index was saved last
+    /// time in the manifest, so they could be recovered after a crash.
+    bool write_manifest();
+
+    /// Serialize the project index, the manifest is removed once it is saved.
+    async::Task<> save_project_index();
+
+    async::Task<> flush_periodically();
+
+    /// Start a flush in background, or run another one after the running one.
+    void request_flush();
+
+    /// Drop the indices of removed files and delete stale files in the index
+    /// directory, in background.
+    async::Task<> sweep();
+
+    /// The priority of a file when nothing is known about it, files outside the
+    /// workspace or in third-party directories are indexed last.
+    IndexQueue::Priority default_priority(llvm::StringRef path);
 
-    /// TODO: Types ...
+    /// The source file itself, or the source files including the header.
+    auto sources_of(llvm::StringRef path) -> llvm::SmallVector<std::uint32_t>;
+
+    /// Schedule the file with high priority if it is a source file, otherwise
+    /// the source files including it.
+    void boost(llvm::StringRef path);
+
+    /// Whether a new job could be started now. An urgent job is allowed to
+    /// exceed the limit by one, and doesn't back off for interactive requests.
+    bool admit(bool urgent = false);
+
+    /// Start jobs for the waiting files as long as they are admitted. If some
+    /// files are left, try again later.
+    void dispatch();
+
+    async::Task<> dispatch_later();
+
+    /// Index the file, the job is removed from `jobs` when done.
+    async::Task<> run_job(std::uint32_t path_id);
+
+    /// Abort the running job of the file, return false if there is none. Its
+    /// compilation is stopped, and nothing is merged.
+    bool cancel_job(std::uint32_t path_id);
+
+    /// Stop running jobs of low priority for the urgent files waiting beyond the
+    /// capacity. The stopped files are indexed again later.
+    void preempt();
+
+    /// Index the main file with its AST, and publish it as the dynamic index.
+    async::Task<> index_main_file(std::uint32_t path_id, std::shared_ptr<CompilationUnit> unit);
+
+    /// Abort indexing the AST of the opened file if it is running.
+    void cancel_main_file(std::uint32_t path_id);
+
+    /// Fold the delta of the merged index into its base in background, if the
+    /// delta grows large enough.
+    void schedule_compact(std::uint32_t path_id);
+
+    async::Task<> compact(std::uint32_t path_id, index::MergedIndex snapshot);
+
+    /// The index of a file for lookups in the thread pool. The dynamic index of
+    /// an opened file shadows its merged index, whose snapshot is taken only if
+    /// the file is not opened.
+    struct IndexView {
+        std::shared_ptr<const index::FileIndex> dynamic;
+
+        index::MergedIndex merged;
+
+        void lookup(index::SymbolHash symbol,
+                    RelationKind kind,
+                    llvm::function_ref<bool(const index::Relation&)> callback) const;
+
+        void reverse_lookup(
+            index::SymbolHash target,
+            RelationKind kind,
+            llvm::function_ref<bool(index::SymbolHash, const index::Relation&)> callback) const;
+
+        /// The line table of the indexed content, the content of the editor for
+        /// an opened file.
+        index::LineTableRef lines() const;
+    };
+
+    IndexView view(std::uint32_t path_id);
+
+    /// Append the opened files which are not in `files`, and whose dynamic indices
+    /// have relations of the symbol. The symbol may be referenced by unsaved
+    /// content only.
+    void add_opened_files(index::SymbolHash symbol, std::vector<std::uint32_t>& files);
+
+    /// Lookup the occurrences containing the offset of the file, in its dynamic
+    /// index if it is opened.
+    void lookup_occurrences(std::uint32_t path_id,
+                            std::uint32_t offset,
+                            llvm::function_ref<bool(const index::Occurrence&)> callback);
+
+    struct SymbolLocation {
+        std::string uri;
+
+        /// The range of the whole declaration.
+        proto::Range range;
+
+        /// The range of the name.
+        proto::Range selection_range;
+    };
+
+    /// Find the definitions of the symbols in their files, or declarations if
+    /// there are no definitions. The files of each symbol are searched in order,
+    /// and the symbols searched in the same file are looked up together.
+    auto locate(llvm::ArrayRef<index::SymbolHash> symbols,
+                std::vector<std::vector<std::uint32_t>> files)
+        -> async::Task<std::vector<std::optional<SymbolLocation>>>;
+
+    /// An edge from a symbol to the target symbol of its relations.
+    struct Edge {
+        /// The other end of the edge.
+        index::SymbolHash target;
+
+        /// The file where the edge is found first.
+        std::uint32_t file;
+
+        /// The ranges of the relations, only for calls.
+        std::vector<proto::Range> ranges;
+    };
+
+    /// Collect the relations of given kind of the item's symbol from all files
+    /// referencing it, grouped by their target symbols. If `reverse` is true,
+    /// collect the relations whose target is the item's symbol instead, grouped
+    /// by their source symbols.
+    auto edges(const proto::CallHierarchyItem& item, RelationKind kind, bool reverse = false)
+        -> async::Task<std::vector<Edge>>;
+
+    /// Build the hierarchy items of the targets of the edges, resolved together.
+    /// If `hinted` is true, the file of each edge is searched first for the
+    /// definition of its target. Unknown symbols give nullopt.
+    auto hierarchy_items(llvm::ArrayRef<Edge> edges, bool hinted)
+        -> async::Task<std::vector<std::optional<proto::CallHierarchyItem>>>;
+
+    /// Convert the ranges in the file to locations in the same order, with the
+    /// line table of its index. It doesn't touch the cache and could be called
+    /// in the thread pool.
+    std::vector<proto::Location> to_locations(index::LineTableRef lines,
+                                              llvm::StringRef path,
+                                              llvm::StringRef uri,
+                                              llvm::ArrayRef<LocalSourceRange> source_ranges) const;
 
 private:
     CompilationDatabase& database;
@@ -79,15 +608,92 @@ private:
 
     PathMapping mapping;
 
-    llvm::DenseMap<std::uint32_t, index::MergedIndex> in_memory_indices;
+    MergedIndexCache in_memory_indices;
+
+    FileStatusCache file_status;
+
+    /// The time when the indices are loaded, files in the index directory newer
+    /// than it are written by this server.
+    llvm::sys::TimePoint<> started_at;
+
+    /// The count of indices written in one task of the thread pool when flushing.
+    constexpr static std::size_t flush_batch_size = 16;
+
+    /// Whether a flush is running.
+    bool flushing = false;
+
+    /// Whether another flush is requested while flushing.
+    bool flush_requested = false;
+
+    /// The dirty indices evicted from the cache, kept until the background
+    /// flush writes them. They are moved back to the cache if needed meanwhile.
+    llvm::DenseMap<std::uint32_t, index::MergedIndex> evicted_indices;
+
+    /// The indices being written in background by the running flush. An index
+    /// written directly meanwhile, e.g. on shutdown, is removed from it, so that
+    /// the older background write is discarded.
+    llvm::DenseSet<std::uint32_t> background_writes;
+
+    /// The index files written after the project index was saved last time,
+    /// keyed by the path id of their source files.
+    llvm::DenseMap<std::uint32_t, std::string> unsaved_indices;
+
+    /// The merged indices being compacted in background.
+    llvm::DenseSet<std::uint32_t> compacting;
+
+    /// The source files in the compilation database.
+    llvm::DenseSet<std::uint32_t> source_files;
+
+    /// The indices of the main files of opened files, built from their ASTs.
+    /// They are shared with the lookups in the thread pool, and replaced as a
+    /// whole when the files are indexed again.
+    llvm::DenseMap<std::uint32_t, std::shared_ptr<const index::FileIndex>> dynamic_indices;
+
+    IndexQueue waitings;
+
+    struct Job {
+        async::Task<> task;
+
+        /// Set to stop the compilation when the job is cancelled.
+        std::shared_ptr<std::atomic_bool> stop;
+
+        IndexQueue::Priority priority;
+
+        /// Whether the job is compiling, a stopped job leaves room only then.
+        bool started = false;
+    };
+
+    /// The running jobs, keyed by their files.
+    llvm::DenseMap<std::uint32_t, Job> jobs;
+
+    /// The tasks indexing the ASTs of opened files, keyed by their files.
+    llvm::DenseMap<std::uint32_t, async::Task<>> main_file_jobs;
+
+    /// Whether `dispatch_later` is waiting.
+    bool dispatch_pending = false;
+
+    IndexAdmission admission;
+
+    /// The interval of checking the admission again for the waiting files, it is
+    /// also the interval of sampling the available memory.
+    constexpr static std::chrono::milliseconds admission_interval =
+        std::chrono::milliseconds(500);
+
+    /// The count of files being compiled in the thread pool.
+    std::size_t running_jobs = 0;
+
+    /// The count of running jobs started after the available memory was sampled.
+    std::size_t fresh_jobs = 0;
+
+    /// The count of cancelled jobs whose compilations haven't returned yet.
+    std::size_t stopping_jobs = 0;
 
-    /// Currently indexes tasks ...
-    std::vector<async::Task<>> workings;
+    std::optional<std::size_t> available_memory;
 
-    /// FIXME: Use a LRU to make sure we won't index a file twice ...
-    std::deque<std::uint32_t> waitings;
+    std::chrono::steady_clock::time_point memory_sampled_at;
 
-    async::Event update_event;
+    /// The count of interactive requests in flight.
+    std::size_t interactive_requests = 0;
 };
 
 }  // namespace clice
@@ -222,6 +222,20 @@ private:
 
     auto on_inlay_hint(proto::InlayHintParams params) -> Result;
 
+    auto on_workspace_symbol(proto::WorkspaceSymbolParams params) -> Result;
+
+    auto on_prepare_call_hierarchy(proto::CallHierarchyPrepareParams params) -> Result;
+
+    auto on_incoming_calls(proto::CallHierarchyIncomingCallsParams params) -> Result;
+
+    auto on_outgoing_calls(proto::CallHierarchyOutgoingCallsParams params) -> Result;
+
+    auto on_prepare_type_hierarchy(proto::TypeHierarchyPrepareParams params) -> Result;
+
+    auto on_supertypes(proto::TypeHierarchySupertypesParams params) -> Result;
+
+    auto on_subtypes(proto::TypeHierarchySubtypesParams params) -> Result;
+
 private:
     /// The current request id.
     std::uint32_t server_request_id = 0;
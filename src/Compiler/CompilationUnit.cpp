@@ -230,6 +230,25 @@ std::chrono::milliseconds CompilationUnit::build_duration() {
     return impl->build_duration;
 }
 
+std::size_t CompilationUnit::memory_usage() {
+    auto& instance = *impl->instance;
+    std::size_t bytes = impl->path_storage.getTotalMemory();
+
+    if(instance.hasASTContext()) {
+        auto& context = instance.getASTContext();
+        bytes += context.getASTAllocatedMemory() + context.getSideTableAllocatedMemory();
+    }
+
+    if(instance.hasPreprocessor()) {
+        bytes += instance.getPreprocessor().getTotalMemory();
+    }
+
+    auto buffers = impl->src_mgr.getMemoryBufferSizes();
+    bytes += buffers.malloc_bytes + buffers.mmap_bytes;
+    bytes += impl->src_mgr.getContentCacheSize() + impl->src_mgr.getDataStructureSizes();
+    return bytes;
+}
+
 clang::LangOptions& CompilationUnit::lang_options() {
     return impl->instance->getLangOpts();
 }
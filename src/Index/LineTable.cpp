@@ -0,0 +1,59 @@
+#include "Index/LineTable.h"
+#include "Support/Ranges.h"
+#include "llvm/ADT/bit.h"
+
+namespace clice::index {
+
+std::pair<std::uint32_t, std::uint32_t>
+    LineTableRef::position(std::uint32_t offset,
+                           llvm::function_ref<std::uint32_t(std::uint32_t)> units) const {
+    assert(!line_starts.empty() && "empty line table");
+
+    auto it = ranges::upper_bound(line_starts, offset);
+    std::uint32_t line = it - line_starts.begin() - 1;
+    std::uint32_t line_start = line_starts[line];
+
+    /// Only the non-ASCII characters before the offset in this line make the
+    /// column differ from the count of bytes.
+    std::uint32_t column = offset - line_start;
+    auto wide_char = ranges::lower_bound(wide_chars, line_start, {}, &WideChar::offset);
+    for(; wide_char != wide_chars.end() && wide_char->offset < offset; ++wide_char) {
+        column = column - wide_char->length + units(wide_char->length);
+    }
+
+    return {line, column};
+}
+
+LineTable LineTable::build(llvm::StringRef content) {
+    LineTable table;
+    table.line_starts.emplace_back(0);
+
+    for(std::uint32_t i = 0; i < content.size();) {
+        auto c = static_cast<unsigned char>(content[i]);
+        if(c == '\n') {
+            table.line_starts.emplace_back(i + 1);
+            i += 1;
+            continue;
+        }
+
+        if(!(c & 0x80)) [[likely]] {
+            i += 1;
+            continue;
+        }
+
+        /// Invalid UTF-8 sequence is treated as an ASCII character, the same as
+        /// `iterateCodepoints`.
+        std::uint32_t length = llvm::countl_one(c);
+        if(length < 2 || length > 4) [[unlikely]] {
+            i += 1;
+            continue;
+        }
+
+        table.wide_chars.emplace_back(i, length);
+        i += length;
+    }
+
+    return table;
+}
+
+}  // namespace clice::index
@@ -1,10 +1,23 @@
+#include <bit>
+#include <mutex>
+#include <limits>
+#include <atomic>
+#include <algorithm>
+
 #include "Serialization.h"
 #include "Support/Compare.h"
 #include "Support/FileSystem.h"
 #include "Index/MergedIndex.h"
 #include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/Support/raw_os_ostream.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
+
 namespace llvm {
 
 template <typename... Ts>
@@ -12,6 +25,28 @@ unsigned dense_hash(const Ts&... ts) {
     return llvm::DenseMapInfo<std::tuple<Ts...>>::getHashValue(std::tuple{ts...});
 }
 
+template <>
+struct DenseMapInfo<clice::index::IndexHash> {
+    using V = clice::index::IndexHash;
+
+    inline static V getEmptyKey() {
+        return V(-1, -1);
+    }
+
+    inline static V getTombstoneKey() {
+        return V(-2, -2);
+    }
+
+    /// The hash is uniformly distributed already.
+    static unsigned getHashValue(const V& v) {
+        return static_cast<unsigned>(v.low);
+    }
+
+    static bool isEqual(const V& lhs, const V& rhs) {
+        return lhs == rhs;
+    }
+};
+
 template <>
 struct DenseMapInfo<clice::index::Occurrence> {
     using R = clice::LocalSourceRange;
@@ -96,12 +131,273 @@ struct CompilationContext {
 
     std::vector<IncludeLocation> include_locations;
 
+    /// Sorted by the path id.
+    std::vector<DependencyHash> dependencies;
+
     friend bool operator== (const CompilationContext&, const CompilationContext&) = default;
 };
 
+/// The occurrences are indexed by an implicit interval tree over the array
+/// sorted by begin, see https://github.com/lh3/cgranges. Leaves are the even
+/// indices, and the node `i` at level `k` covers `[i - 2^k + 1, i + 2^k - 1]`.
+/// Each node records the max end of the intervals it covers.
+void build_max_ends(std::size_t size, auto&& end_of, auto& max_ends) {
+    max_ends.resize(size);
+    if(size == 0) {
+        return;
+    }
+
+    /// The last node at current level and its max end, the subtree of the last
+    /// node may be incomplete, so it is propagated specially.
+    std::size_t last_i = 0;
+    std::uint32_t last = 0;
+    for(std::size_t i = 0; i < size; i += 2) {
+        last_i = i;
+        last = max_ends[i] = end_of(i);
+    }
+
+    for(std::size_t k = 1; (std::size_t(1) << k) <= size; k++) {
+        std::size_t x = std::size_t(1) << (k - 1);
+        for(std::size_t i = (x << 1) - 1; i < size; i += x << 2) {
+            std::uint32_t left = max_ends[i - x];
+            std::uint32_t right = i + x < size ? max_ends[i + x] : last;
+            max_ends[i] = std::max({end_of(i), left, right});
+        }
+
+        last_i = (last_i >> k & 1) ? last_i - x : last_i + x;
+        if(last_i < size && max_ends[last_i] > last) {
+            last = max_ends[last_i];
+        }
+    }
+}
+
+/// Visit the index of every interval containing the offset in ascending order
+/// of begin, in O(log n + k). Return false if the callback stops it.
+bool stab(std::size_t size,
+          std::uint32_t offset,
+          auto&& begin_of,
+          auto&& end_of,
+          auto&& max_end_of,
+          auto&& callback) {
+    if(size == 0) {
+        return true;
+    }
+
+    struct Node {
+        std::uint32_t level;
+        std::size_t index;
+        bool left_visited;
+    };
+
+    Node stack[64];
+    std::size_t top = 0;
+
+    std::uint32_t root = std::bit_width(size) - 1;
+    stack[top++] = {root, (std::size_t(1) << root) - 1, false};
+
+    while(top != 0) {
+        auto [level, i, left_visited] = stack[--top];
+        if(level <= 3) {
+            /// The subtree is small, scan it linearly.
+            std::size_t first = i >> level << level;
+            std::size_t last = std::min(first + (std::size_t(1) << (level + 1)) - 1, size);
+            for(auto j = first; j < last && begin_of(j) <= offset; j++) {
+                if(offset <= end_of(j) && !callback(j)) {
+                    return false;
+                }
+            }
+        } else if(!left_visited) {
+            /// The left child may be out of range while its descendants are not.
+            std::size_t left = i - (std::size_t(1) << (level - 1));
+            stack[top++] = {level, i, true};
+            if(left >= size || max_end_of(left) >= offset) {
+                stack[top++] = {level - 1, left, false};
+            }
+        } else if(i < size && begin_of(i) <= offset) {
+            if(offset <= end_of(i) && !callback(i)) {
+                return false;
+            }
+            stack[top++] = {level - 1, i + (std::size_t(1) << (level - 1)), false};
+        }
+    }
+
+    return true;
+}
+
+/// A sorted table of occurrences in struct-of-arrays layout. Binary searches
+/// only touch the array they compare, and the table is kept sorted by merging,
+/// so it never needs rebuilding before lookup.
+class OccurrenceTable {
+public:
+    std::size_t size() const {
+        return begins.size();
+    }
+
+    bool empty() const {
+        return begins.empty();
+    }
+
+    Occurrence operator[] (std::size_t i) const {
+        return Occurrence{LocalSourceRange(begins[i], ends[i]), targets[i]};
+    }
+
+    roaring::Roaring& context(std::size_t i) {
+        return contexts[context_ids[i]];
+    }
+
+    const roaring::Roaring& context(std::size_t i) const {
+        return contexts[context_ids[i]];
+    }
+
+    /// Merge the sorted and unique occurrences into the table. The `add` is
+    /// called with the context and the position of each given occurrence.
+    void merge(llvm::ArrayRef<Occurrence> occurrences, auto&& add) {
+        /// The position of occurrences not in the table yet, with their new
+        /// context ids.
+        llvm::SmallVector<std::pair<std::uint32_t, std::uint32_t>> pending;
+
+        for(std::uint32_t i = 0; i < occurrences.size(); i++) {
+            auto position = find(occurrences[i]);
+            if(position != size()) {
+                add(context(position), i);
+                continue;
+            }
+
+            auto context_id = static_cast<std::uint32_t>(contexts.size());
+            add(contexts.emplace_back(), i);
+            pending.emplace_back(i, context_id);
+        }
+
+        if(pending.empty()) {
+            return;
+        }
+
+        /// Merge from back to front in place, every row moves at most once.
+        auto i = size();
+        auto j = pending.size();
+        auto k = i + j;
+        begins.resize(k);
+        ends.resize(k);
+        targets.resize(k);
+        context_ids.resize(k);
+
+        while(j > 0) {
+            k -= 1;
+            auto& [position, context_id] = pending[j - 1];
+            if(i > 0 && refl::less(occurrences[position], (*this)[i - 1])) {
+                i -= 1;
+                begins[k] = begins[i];
+                ends[k] = ends[i];
+                targets[k] = targets[i];
+                context_ids[k] = context_ids[i];
+            } else {
+                j -= 1;
+                begins[k] = occurrences[position].range.begin;
+                ends[k] = occurrences[position].range.end;
+                targets[k] = occurrences[position].target;
+                context_ids[k] = context_id;
+            }
+        }
+
+        build_max_ends(size(), [&](std::size_t i) { return ends[i]; }, max_ends);
+    }
+
+    /// Remove the occurrences whose context satisfies the `drop` predicate,
+    /// which could also update the context in place. Return the removed count.
+    std::size_t remove_if(auto&& drop) {
+        std::vector<roaring::Roaring> new_contexts;
+        std::size_t k = 0;
+        for(std::size_t i = 0; i < size(); i++) {
+            auto& context = this->context(i);
+            if(drop(context)) {
+                continue;
+            }
+
+            begins[k] = begins[i];
+            ends[k] = ends[i];
+            targets[k] = targets[i];
+            context_ids[k] = static_cast<std::uint32_t>(new_contexts.size());
+            new_contexts.emplace_back(std::move(context));
+            k += 1;
+        }
+
+        auto removed = size() - k;
+        begins.resize(k);
+        ends.resize(k);
+        targets.resize(k);
+        context_ids.resize(k);
+        contexts = std::move(new_contexts);
+        build_max_ends(size(), [&](std::size_t i) { return ends[i]; }, max_ends);
+        return removed;
+    }
+
+    /// Visit the occurrences containing the offset.
+    void lookup(std::uint32_t offset, auto&& callback) const {
+        stab(
+            size(),
+            offset,
+            [&](std::size_t i) { return begins[i]; },
+            [&](std::size_t i) { return ends[i]; },
+            [&](std::size_t i) { return max_ends[i]; },
+            [&](std::size_t i) { return callback((*this)[i]); });
+    }
+
+    std::size_t memory_usage() const {
+        return begins.capacity() * sizeof(std::uint32_t) +
+               ends.capacity() * sizeof(std::uint32_t) +
+               targets.capacity() * sizeof(SymbolHash) +
+               context_ids.capacity() * sizeof(std::uint32_t) +
+               max_ends.capacity() * sizeof(std::uint32_t) +
+               contexts.capacity() * sizeof(roaring::Roaring);
+    }
+
+    friend bool operator== (const OccurrenceTable& lhs, const OccurrenceTable& rhs) {
+        if(lhs.begins != rhs.begins || lhs.ends != rhs.ends || lhs.targets != rhs.targets) {
+            return false;
+        }
+
+        for(std::size_t i = 0; i < lhs.size(); i++) {
+            if(lhs.context(i) != rhs.context(i)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+private:
+    /// Return the position of the occurrence, or `size()` if not found.
+    std::size_t find(const Occurrence& occurrence) const {
+        std::size_t i = ranges::lower_bound(begins, occurrence.range.begin) - begins.begin();
+        for(; i < size() && begins[i] == occurrence.range.begin; i++) {
+            if(ends[i] == occurrence.range.end && targets[i] == occurrence.target) {
+                return i;
+            }
+        }
+        return size();
+    }
+
+private:
+    std::vector<std::uint32_t> begins;
+
+    std::vector<std::uint32_t> ends;
+
+    std::vector<SymbolHash> targets;
+
+    /// The offset of context bitmap of each occurrence in `contexts`.
+    std::vector<std::uint32_t> context_ids;
+
+    /// The context bitmaps, in the order of insertion.
+    std::vector<roaring::Roaring> contexts;
+
+    /// The max end of each node in the implicit interval tree.
+    std::vector<std::uint32_t> max_ends;
+};
+
 struct MergedIndex::Impl {
-    /// The content of corresponding source file.
-    std::string content;
+    /// The line table of the latest merged content, empty if it is the same as
+    /// the one in base.
+    LineTable lines;
 
     /// If this file is included by other source file, then it has header contexts.
     /// The key represents the source file id, value represents the context in the
@@ -113,9 +409,9 @@ struct MergedIndex::Impl {
     /// could provide header contexts for other files.
     llvm::SmallDenseMap<std::uint32_t, CompilationContext, 1> compilation_contexts;
 
-    /// We use the value of SHA256 to judge whether two indices are same.
+    /// We use the content hash to judge whether two indices are same.
     /// The same indices will be given same canonical id.
-    llvm::StringMap<std::uint32_t> canonical_cache;
+    llvm::DenseMap<IndexHash, std::uint32_t> canonical_cache;
 
     /// The max canonical id we have allocated.
     std::uint32_t max_canonical_id = 0;
@@ -126,48 +422,551 @@ struct MergedIndex::Impl {
     /// The canonical id set of removed index.
     roaring::Roaring removed;
 
-    /// All merged symbol occurrences.
-    llvm::DenseMap<Occurrence, roaring::Roaring> occurrences;
+    /// The symbol occurrences merged after the base buffer was built. Canonical
+    /// ids are never reused, so this is an append-only delta over the base and
+    /// the base is never modified in place.
+    OccurrenceTable occurrences;
 
-    /// All merged symbol relations.
+    /// The symbol relations merged after the base buffer was built.
     llvm::DenseMap<SymbolHash, llvm::DenseMap<Relation, roaring::Roaring>> relations;
 
-    /// Sorted occurrences cache for fast lookup.
-    std::vector<Occurrence> occurrences_cache;
+    /// The count of relations in the delta.
+    std::size_t relations_count = 0;
+
+    /// The source symbols of the relations in delta, keyed by their target
+    /// symbols. The sources are sorted, so that the order of merging does not
+    /// matter.
+    llvm::DenseMap<SymbolHash, llvm::SmallVector<SymbolHash, 2>> reverse_relations;
 
-    void merge(this Impl& self, std::uint32_t path_id, FileIndex& index, auto&& add_context) {
+    /// Record the source of the relation for reverse lookup, if the relation
+    /// has a target symbol.
+    void add_reverse(this Impl& self, SymbolHash source, Relation relation) {
+        if(!relation.kind.isBetweenSymbol() && !relation.kind.isCall()) {
+            return;
+        }
+
+        auto& sources = self.reverse_relations[relation.target_symbol];
+        auto it = ranges::lower_bound(sources, source);
+        if(it == sources.end() || *it != source) {
+            sources.insert(it, source);
+        }
+    }
+
+    IndexHash merge(this Impl& self, std::uint32_t path_id, FileIndex& index, auto&& add_context) {
         auto hash = index.hash();
-        auto hash_key = llvm::StringRef(reinterpret_cast<char*>(hash.data()), hash.size());
-        auto [it, success] = self.canonical_cache.try_emplace(hash_key, self.max_canonical_id);
+        auto [it, success] = self.canonical_cache.try_emplace(hash, self.max_canonical_id);
 
         auto canonical_id = it->second;
         add_context(self, canonical_id);
 
+        if(!index.lines.empty()) {
+            self.lines = index.lines;
+        }
+
         if(!success) {
             self.canonical_ref_counts[canonical_id] += 1;
             self.removed.remove(canonical_id);
+            return hash;
+        }
+
+        self.occurrences.merge(index.occurrences, [&](roaring::Roaring& context, std::uint32_t) {
+            context.add(canonical_id);
+        });
+        self.merge_relations(index, canonical_id);
+
+        self.canonical_ref_counts.emplace_back(1);
+        self.max_canonical_id += 1;
+        return hash;
+    }
+
+    /// Merge multiple indices at once, `add_context` is called with the position
+    /// of each index and its canonical id. The new indices are merged together,
+    /// so that the occurrence table is rebuilt once and the bitmaps are filled
+    /// in bulk. Their hashes are written to `hashes`.
+    void merge_batch(this Impl& self,
+                     llvm::ArrayRef<FileIndex*> indices,
+                     llvm::MutableArrayRef<IndexHash> hashes,
+                     auto&& add_context) {
+        llvm::SmallVector<std::pair<FileIndex*, std::uint32_t>> fresh;
+        std::size_t occurrence_count = 0;
+        std::size_t symbol_count = 0;
+
+        self.canonical_cache.reserve(self.canonical_cache.size() + indices.size());
+        for(std::size_t i = 0; i < indices.size(); i++) {
+            auto& index = *indices[i];
+            hashes[i] = index.hash();
+            auto [it, success] = self.canonical_cache.try_emplace(hashes[i], self.max_canonical_id);
+
+            auto canonical_id = it->second;
+            add_context(self, i, canonical_id);
+
+            if(!index.lines.empty()) {
+                self.lines = index.lines;
+            }
+
+            /// Either known before or a duplicate in the batch.
+            if(!success) {
+                self.canonical_ref_counts[canonical_id] += 1;
+                self.removed.remove(canonical_id);
+                continue;
+            }
+
+            fresh.emplace_back(&index, canonical_id);
+            occurrence_count += index.occurrences.size();
+            symbol_count = std::max(symbol_count, index.relations.size());
+            self.canonical_ref_counts.emplace_back(1);
+            self.max_canonical_id += 1;
+        }
+
+        if(fresh.empty()) {
             return;
         }
 
-        for(auto& occurrence: index.occurrences) {
-            self.occurrences[occurrence].add(canonical_id);
+        /// Tag every occurrence with its canonical id and sort them together. The
+        /// canonical ids are ascending in `fresh`, so a stable sort makes the ids
+        /// of the same occurrence a sorted run.
+        llvm::SmallVector<std::pair<Occurrence, std::uint32_t>, 0> tagged;
+        tagged.reserve(occurrence_count);
+        for(auto [index, canonical_id]: fresh) {
+            for(auto& occurrence: index->occurrences) {
+                tagged.emplace_back(occurrence, canonical_id);
+            }
+        }
+        ranges::stable_sort(tagged, refl::less, [](auto& entry) -> auto& { return entry.first; });
+
+        llvm::SmallVector<Occurrence, 0> occurrences;
+        llvm::SmallVector<std::uint32_t, 0> canonical_ids;
+        llvm::SmallVector<std::uint32_t, 0> starts;
+        for(auto& [occurrence, canonical_id]: tagged) {
+            if(occurrences.empty() || !(occurrences.back() == occurrence)) {
+                occurrences.emplace_back(occurrence);
+                starts.emplace_back(canonical_ids.size());
+            }
+            canonical_ids.emplace_back(canonical_id);
+        }
+        starts.emplace_back(canonical_ids.size());
+
+        self.occurrences.merge(occurrences, [&](roaring::Roaring& context, std::uint32_t i) {
+            context.addMany(starts[i + 1] - starts[i], canonical_ids.data() + starts[i]);
+        });
+
+        self.relations.reserve(self.relations.size() + symbol_count);
+        for(auto [index, canonical_id]: fresh) {
+            self.merge_relations(*index, canonical_id);
         }
+    }
 
+    void merge_relations(this Impl& self, FileIndex& index, std::uint32_t canonical_id) {
         for(auto& [symbol_id, relations]: index.relations) {
             auto& target = self.relations[symbol_id];
             for(auto& relation: relations) {
-                target[relation].add(canonical_id);
+                auto [entry, inserted] = target.try_emplace(relation);
+                entry->second.add(canonical_id);
+                self.relations_count += inserted;
+                if(inserted) {
+                    self.add_reverse(symbol_id, relation);
+                }
             }
         }
+    }
 
-        self.canonical_ref_counts.emplace_back(1);
-        self.max_canonical_id += 1;
+    /// Release a reference to the canonical id.
+    void release(this Impl& self, std::uint32_t canonical_id) {
+        auto& ref_counts = self.canonical_ref_counts[canonical_id];
+        ref_counts -= 1;
+
+        if(ref_counts == 0) {
+            self.removed.add(canonical_id);
+        }
+    }
+
+    /// Drop the removed canonical ids and renumber the rest densely. All the
+    /// occurrences and relations must be in memory.
+    void collect_garbage(this Impl& self, CompactStatistics& stats) {
+        auto& removed = self.removed;
+        if(removed.isEmpty()) {
+            return;
+        }
+
+        /// Canonical ids less than this are not affected by renumbering.
+        auto first_removed = removed.minimum();
+
+        auto remap = [&](std::uint32_t canonical_id) {
+            if(canonical_id < first_removed) {
+                return canonical_id;
+            }
+            return canonical_id - static_cast<std::uint32_t>(removed.rank(canonical_id));
+        };
+
+        /// Return false if the bitmap becomes empty.
+        auto remap_bitmap = [&](roaring::Roaring& bitmap) {
+            auto size = bitmap.getSizeInBytes(false);
+            bitmap -= removed;
+            if(bitmap.isEmpty()) {
+                stats.reclaimed_bytes += size;
+                return false;
+            }
+
+            if(bitmap.maximum() >= first_removed) {
+                roaring::Roaring result;
+                for(auto canonical_id: bitmap) {
+                    result.add(remap(canonical_id));
+                }
+                bitmap = std::move(result);
+            }
+
+            stats.reclaimed_bytes += size - std::min(size, bitmap.getSizeInBytes(false));
+            return true;
+        };
+
+        stats.occurrences = self.occurrences.remove_if(
+            [&](roaring::Roaring& context) { return !remap_bitmap(context); });
+        stats.reclaimed_bytes += stats.occurrences * sizeof(Occurrence);
+
+        for(auto it = self.relations.begin(); it != self.relations.end();) {
+            auto current = it++;
+            auto& relations = current->second;
+            for(auto rit = relations.begin(); rit != relations.end();) {
+                auto relation = rit++;
+                if(!remap_bitmap(relation->second)) {
+                    relations.erase(relation);
+                    stats.relations += 1;
+                    stats.reclaimed_bytes += sizeof(Relation);
+                }
+            }
+
+            if(relations.empty()) {
+                self.relations.erase(current);
+                stats.reclaimed_bytes += sizeof(SymbolHash);
+            }
+        }
+
+        /// Rebuild the reverse relations from the surviving ones.
+        self.reverse_relations.clear();
+        for(auto& [symbol_id, relations]: self.relations) {
+            for(auto& [relation, _]: relations) {
+                self.add_reverse(symbol_id, relation);
+            }
+        }
+
+        for(auto it = self.canonical_cache.begin(); it != self.canonical_cache.end();) {
+            auto current = it++;
+            if(removed.contains(current->second)) {
+                stats.reclaimed_bytes += sizeof(IndexHash) + sizeof(std::uint32_t);
+                self.canonical_cache.erase(current);
+            } else {
+                current->second = remap(current->second);
+            }
+        }
+
+        for(auto& [_, context]: self.header_contexts) {
+            for(auto& include: context.includes) {
+                include.canonical_id = remap(include.canonical_id);
+            }
+        }
+
+        for(auto& [_, context]: self.compilation_contexts) {
+            context.canonical_id = remap(context.canonical_id);
+        }
+
+        std::vector<std::uint32_t> ref_counts;
+        ref_counts.reserve(self.canonical_ref_counts.size() - removed.cardinality());
+        for(std::uint32_t i = 0; i < self.canonical_ref_counts.size(); i++) {
+            if(!removed.contains(i)) {
+                ref_counts.emplace_back(self.canonical_ref_counts[i]);
+            }
+        }
+        self.canonical_ref_counts = std::move(ref_counts);
+
+        self.relations_count -= stats.relations;
+        stats.canonical_ids = removed.cardinality();
+        self.max_canonical_id -= static_cast<std::uint32_t>(stats.canonical_ids);
+        self.removed = roaring::Roaring();
     }
 
     friend bool operator== (const Impl&, const Impl&) = default;
 };
 
-MergedIndex::MergedIndex(std::unique_ptr<llvm::MemoryBuffer> buffer, std::unique_ptr<Impl> impl) :
+namespace {
+
+/// A read only memory buffer backed by the pages of index file. Unlike
+/// `llvm::MemoryBuffer::getFile`, which may fall back to reading the whole
+/// file into heap, the mapping is always used here.
+class MappedBuffer : public llvm::MemoryBuffer {
+public:
+    MappedBuffer(fs::mapped_file_region region,
+                 llvm::StringRef path,
+                 llvm::sys::TimePoint<> modified_time) :
+        region(std::move(region)), path(path), modified_time(modified_time) {
+        init(this->region.const_data(),
+             this->region.const_data() + this->region.size(),
+             false);
+    }
+
+    llvm::StringRef getBufferIdentifier() const override {
+        return path;
+    }
+
+    BufferKind getBufferKind() const override {
+        return MemoryBuffer_MMap;
+    }
+
+    void dontNeedIfMmapped() override {
+        region.dontNeed();
+    }
+
+    /// The modification time of the file when it was mapped.
+    llvm::sys::TimePoint<> modified() const {
+        return modified_time;
+    }
+
+    static std::unique_ptr<MappedBuffer> map(llvm::StringRef path, bool populate) {
+        auto file = fs::openNativeFileForRead(path);
+        if(!file) {
+            llvm::consumeError(file.takeError());
+            return nullptr;
+        }
+
+        auto close = llvm::make_scope_exit([&] { fs::closeFile(*file); });
+
+        fs::file_status status;
+        if(auto err = fs::status(*file, status); err || status.getSize() == 0) {
+            return nullptr;
+        }
+
+        std::error_code err;
+        fs::mapped_file_region region(*file,
+                                      fs::mapped_file_region::readonly,
+                                      status.getSize(),
+                                      0,
+                                      err);
+        if(err) {
+            return nullptr;
+        }
+
+#if defined(__unix__) || defined(__APPLE__)
+        /// Lookups are binary searches, readahead would only pull in pages we
+        /// never touch. Unless the caller wants the whole file resident.
+        ::madvise(const_cast<char*>(region.const_data()),
+                  region.size(),
+                  populate ? MADV_WILLNEED : MADV_RANDOM);
+#endif
+
+        return std::make_unique<MappedBuffer>(std::move(region),
+                                              path,
+                                              status.getLastModificationTime());
+    }
+
+private:
+    fs::mapped_file_region region;
+    std::string path;
+    llvm::sys::TimePoint<> modified_time;
+};
+
+/// The file identifier of merged index files, and the version of their layout.
+/// Bump the version whenever the layout changes incompatibly.
+constexpr char merged_index_identifier[] = "CMIX";
+constexpr std::uint32_t merged_index_format = 1;
+
+/// Check whether the mapped file is a merged index of current layout. A file is
+/// verified in whole only when it is mapped first time in the process or it has
+/// changed since, which reads every page of it. Otherwise only its header is
+/// checked, so reloading an evicted index stays cheap.
+bool verify(const MappedBuffer& buffer) {
+    auto data = reinterpret_cast<const std::uint8_t*>(buffer.getBufferStart());
+    auto size = buffer.getBufferSize();
+
+    /// The root offset and the identifier.
+    if(size < sizeof(fbs::uoffset_t) * 2 ||
+       !fbs::BufferHasIdentifier(data, merged_index_identifier)) {
+        return false;
+    }
+
+    auto root_offset = fbs::ReadScalar<fbs::uoffset_t>(data);
+    if(root_offset % alignof(fbs::uoffset_t) != 0 || root_offset > size - sizeof(fbs::soffset_t)) {
+        return false;
+    }
+
+    static std::mutex mutex;
+    static llvm::StringMap<std::pair<std::size_t, llvm::sys::TimePoint<>>> verified;
+
+    std::pair status{size, buffer.modified()};
+    {
+        std::lock_guard guard(mutex);
+        if(auto it = verified.find(buffer.getBufferIdentifier());
+           it != verified.end() && it->second == status) {
+            return true;
+        }
+    }
+
+    /// Every relation entry is a table, don't limit the count of tables.
+    fbs::Verifier::Options options;
+    options.max_tables = std::numeric_limits<fbs::uoffset_t>::max();
+    fbs::Verifier verifier(data, size, options);
+    if(!verifier.VerifyBuffer<binary::MergedIndex>(merged_index_identifier)) {
+        return false;
+    }
+
+    auto root = fbs::GetRoot<binary::MergedIndex>(data);
+    if(root->format() != merged_index_format) {
+        return false;
+    }
+
+    std::lock_guard guard(mutex);
+    verified[buffer.getBufferIdentifier()] = status;
+    return true;
+}
+
+/// The delta is folded into the base once it holds this many entries, and is
+/// large enough compared to the base to amortize rewriting the whole base.
+constexpr std::size_t compaction_threshold = 4096;
+
+/// Each modification gives the index a new version which is unique in the
+/// process, so a stale snapshot could never be mistaken for the current one.
+std::atomic<std::uint64_t> next_version = 1;
+
+/// The high bit of a context reference marks a shared context bitmap, see the
+/// schema of `MergedIndex`.
+constexpr std::uint32_t shared_context = std::uint32_t(1) << 31;
+
+/// An occurrence in base, the same layout as in binary.
+struct OccurrenceEntry {
+    LocalSourceRange range;
+    std::uint32_t symbol;
+};
+
+/// A relation in base, the same layout as in binary.
+struct RelationEntry {
+    Relation relation;
+    std::uint32_t context;
+    std::uint32_t padding = 0;
+};
+
+const Relation& relation_of(const RelationEntry& entry) {
+    return entry.relation;
+}
+
+/// The relations of the i-th symbol in `relation_symbols`.
+llvm::ArrayRef<RelationEntry> relations_of(const binary::MergedIndex* root, std::size_t i) {
+    return as_array<RelationEntry>(root->relations()->Get(i)->relations());
+}
+
+/// The occurrences in base, their targets are decoded on access.
+struct BaseOccurrences {
+    llvm::ArrayRef<OccurrenceEntry> entries;
+
+    llvm::ArrayRef<SymbolHash> symbols;
+
+    llvm::ArrayRef<std::uint32_t> contexts;
+
+    explicit BaseOccurrences(const binary::MergedIndex* root) {
+        if(root) {
+            entries = as_array<OccurrenceEntry>(root->occurrences());
+            symbols = as_array(root->symbols());
+            contexts = as_array(root->occurrence_contexts());
+        }
+    }
+
+    std::size_t size() const {
+        return entries.size();
+    }
+
+    Occurrence operator[] (std::size_t i) const {
+        return Occurrence{entries[i].range, symbols[entries[i].symbol]};
+    }
+};
+
+/// Decode the context of given reference in base.
+roaring::Roaring read_context(const binary::MergedIndex* root, std::uint32_t context) {
+    if(context & shared_context) {
+        return read_bitmap(root->context_bitmaps()->Get(context & ~shared_context)->context());
+    }
+
+    roaring::Roaring bitmap;
+    bitmap.add(context);
+    return bitmap;
+}
+
+/// Write the contexts and return their references. A context of single canonical
+/// id is inlined in its reference, the others are written once and shared by all
+/// entries with the same context.
+class ContextWriter {
+public:
+    explicit ContextWriter(fbs::FlatBufferBuilder& builder) : builder(builder) {}
+
+    std::uint32_t write(const roaring::Roaring& bitmap) {
+        if(bitmap.cardinality() == 1) {
+            assert(bitmap.minimum() < shared_context && "too many canonical ids");
+            return bitmap.minimum();
+        }
+
+        buffer.resize_for_overwrite(bitmap.getSizeInBytes(false));
+        bitmap.write(buffer.data(), false);
+        return share(llvm::StringRef(buffer.data(), buffer.size()));
+    }
+
+    /// Copy the context reference from base, shared bitmaps are not decoded.
+    std::uint32_t copy(const binary::MergedIndex* root, std::uint32_t context) {
+        if(!(context & shared_context)) {
+            return context;
+        }
+
+        auto bitmap = root->context_bitmaps()->Get(context & ~shared_context)->context();
+        return share(
+            llvm::StringRef(reinterpret_cast<const char*>(bitmap->data()), bitmap->size()));
+    }
+
+    auto finish() {
+        return CreateVector(builder, bitmaps);
+    }
+
+private:
+    std::uint32_t share(llvm::StringRef data) {
+        auto [it, success] = cache.try_emplace(data, bitmaps.size());
+        if(success) {
+            auto bytes = reinterpret_cast<const std::uint8_t*>(data.data());
+            bitmaps.emplace_back(
+                binary::CreateContextBitmap(builder, builder.CreateVector(bytes, data.size())));
+        }
+        return it->second | shared_context;
+    }
+
+    fbs::FlatBufferBuilder& builder;
+
+    llvm::SmallVector<char, 1024> buffer;
+
+    /// The position of each written bitmap, keyed by its serialized bytes.
+    llvm::StringMap<std::uint32_t> cache;
+
+    Offsets<binary::ContextBitmap> bitmaps;
+};
+
+/// An entry of the canonical cache, the same layout as in binary.
+struct CacheEntry {
+    IndexHash hash;
+    std::uint32_t canonical_id;
+    std::uint32_t padding = 0;
+};
+
+/// An entry of the reverse relation table, the same layout as in binary.
+struct ReverseRelation {
+    SymbolHash target;
+    SymbolHash source;
+
+    friend bool operator== (const ReverseRelation&, const ReverseRelation&) = default;
+
+    friend auto operator<=> (const ReverseRelation&, const ReverseRelation&) = default;
+};
+
+/// Whether the sorted relation entries in base contain the given relation.
+bool contains(llvm::ArrayRef<RelationEntry> entries, const Relation& relation) {
+    auto it = ranges::lower_bound(entries, relation, refl::less, relation_of);
+    return it != entries.end() && refl::equal(relation_of(*it), relation);
+}
+
+}  // namespace
+
+MergedIndex::MergedIndex(std::shared_ptr<llvm::MemoryBuffer> buffer, std::unique_ptr<Impl> impl) :
     buffer(std::move(buffer)), impl(std::move(impl)) {}
 
 MergedIndex::MergedIndex() = default;
@@ -181,12 +980,16 @@ MergedIndex& MergedIndex::operator= (MergedIndex&& other) = default;
 
 MergedIndex::~MergedIndex() = default;
 
-void MergedIndex::load_in_memory(this Self& self) {
+void MergedIndex::load_metadata(this Self& self) {
     if(self.impl) {
+        /// Copy on write, the snapshots still see the delta when they were taken.
+        if(self.impl.use_count() > 1) {
+            self.impl = std::make_shared<Impl>(*self.impl);
+        }
         return;
     }
 
-    self.impl = std::make_unique<MergedIndex::Impl>();
+    self.impl = std::make_shared<MergedIndex::Impl>();
     if(!self.buffer) {
         return;
     }
@@ -196,8 +999,10 @@ void MergedIndex::load_in_memory(this Self& self) {
 
     index.max_canonical_id = root->max_canonical_id();
 
-    for(auto entry: *root->canonical_cache()) {
-        index.canonical_cache.try_emplace(entry->sha256()->string_view(), entry->canonical_id());
+    auto canonical_cache = as_array<CacheEntry>(root->canonical_cache());
+    index.canonical_cache.reserve(canonical_cache.size());
+    for(auto& entry: canonical_cache) {
+        index.canonical_cache.try_emplace(entry.hash, entry.canonical_id);
     }
 
     index.canonical_ref_counts.resize(index.max_canonical_id, 0);
@@ -222,53 +1027,95 @@ void MergedIndex::load_in_memory(this Self& self) {
         for(auto include: *entry->include_locations()) {
             context.include_locations.emplace_back(*safe_cast<IncludeLocation>(include));
         }
+        auto dependencies = as_array<DependencyHash>(entry->dependencies());
+        context.dependencies.assign(dependencies.begin(), dependencies.end());
+        index.canonical_ref_counts[context.canonical_id] += 1;
         index.compilation_contexts.try_emplace(path, std::move(context));
     }
 
-    for(auto entry: *root->occurrences()) {
-        index.occurrences.try_emplace(*safe_cast<Occurrence>(entry->occurrence()),
-                                      read_bitmap(entry->context()));
+    /// The removed set is not serialized, recover it from the reference counts.
+    for(std::uint32_t i = 0; i < index.max_canonical_id; i++) {
+        if(index.canonical_ref_counts[i] == 0) {
+            index.removed.add(i);
+        }
+    }
+}
+
+void MergedIndex::load_in_memory(this Self& self) {
+    self.load_metadata();
+    if(!self.buffer) {
+        return;
+    }
+
+    auto& index = *self.impl;
+    auto root = fbs::GetRoot<binary::MergedIndex>(self.buffer->getBufferStart());
+
+    BaseOccurrences base_occurrences(root);
+    llvm::SmallVector<Occurrence, 0> occurrences;
+    occurrences.reserve(base_occurrences.size());
+    for(std::size_t i = 0; i < base_occurrences.size(); i++) {
+        occurrences.emplace_back(base_occurrences[i]);
     }
+    index.occurrences.merge(occurrences, [&](roaring::Roaring& context, std::uint32_t i) {
+        context |= read_context(root, base_occurrences.contexts[i]);
+    });
 
-    for(auto entry: *root->relations()) {
-        auto& relations = index.relations[entry->symbol()];
-        for(auto relation_entry: *entry->relations()) {
-            relations.try_emplace(*safe_cast<Relation>(relation_entry->relation()),
-                                  read_bitmap(relation_entry->context()));
+    auto relation_symbols = as_array(root->relation_symbols());
+    for(std::size_t i = 0; i < relation_symbols.size(); i++) {
+        auto& target = index.relations[relation_symbols[i]];
+        for(auto& relation_entry: relations_of(root, i)) {
+            auto [entry, inserted] = target.try_emplace(relation_entry.relation);
+            entry->second |= read_context(root, relation_entry.context);
+            index.relations_count += inserted;
+            if(inserted) {
+                index.add_reverse(relation_symbols[i], entry->first);
+            }
         }
     }
 
+    if(index.lines.empty()) {
+        auto lines = self.lines();
+        index.lines.line_starts = lines.line_starts.vec();
+        index.lines.wide_chars = lines.wide_chars.vec();
+    }
+
     self.buffer.reset();
 }
 
-MergedIndex MergedIndex::load(llvm::StringRef path) {
-    auto buffer = llvm::MemoryBuffer::getFile(path);
-    if(!buffer) {
+MergedIndex MergedIndex::load(llvm::StringRef path, bool populate) {
+    /// A truncated file, or a file written by another version, is treated like
+    /// a missing one, the source file is indexed again then.
+    auto buffer = MappedBuffer::map(path, populate);
+    if(!buffer || !verify(*buffer)) {
         return MergedIndex();
     } else {
-        return MergedIndex(std::move(*buffer), nullptr);
+        return MergedIndex(std::move(buffer), nullptr);
     }
 }
 
 void MergedIndex::serialize(this const Self& self, llvm::raw_ostream& out) {
-    if(self.buffer) {
-        out.write(self.buffer->getBufferStart(), self.buffer->getBufferSize());
-        return;
-    }
-
     if(!self.impl) {
+        if(self.buffer) {
+            out.write(self.buffer->getBufferStart(), self.buffer->getBufferSize());
+        }
         return;
     }
 
     auto& index = self.impl;
 
+    /// The immutable base, its entries are merged with the delta on the fly.
+    const binary::MergedIndex* base = nullptr;
+    if(self.buffer) {
+        base = fbs::GetRoot<binary::MergedIndex>(self.buffer->getBufferStart());
+    }
+
     fbs::FlatBufferBuilder builder(1024);
 
-    llvm::SmallVector<char, 1024> buffer;
+    ContextWriter contexts(builder);
 
     auto canonical_cache = transform(index->canonical_cache, [&](auto&& value) {
         auto&& [hash, canonical_id] = value;
-        return binary::CreateCacheEntry(builder, CreateString(builder, hash), canonical_id);
+        return CacheEntry{hash, canonical_id};
     });
 
     auto header_contexts = transform(index->header_contexts, [&](auto&& value) {
@@ -288,55 +1135,198 @@ void MergedIndex::serialize(this const Self& self, llvm::raw_ostream& out) {
             context.version,
             context.canonical_id,
             context.build_at,
-            CreateStructVector<binary::IncludeLocation>(builder, context.include_locations));
+            CreateStructVector<binary::IncludeLocation>(builder, context.include_locations),
+            CreateStructVector<binary::DependencyHash>(builder, context.dependencies));
     });
 
-    llvm::SmallVector<const Occurrence*> occurrence_keys;
-    occurrence_keys.reserve(index->occurrences.size());
-    auto occurrences = transform(index->occurrences, [&](auto&& value) {
-        auto&& [occurrence, bitmap] = value;
-        buffer.clear();
-        buffer.resize_for_overwrite(bitmap.getSizeInBytes(false));
-        bitmap.write(buffer.data(), false);
-        occurrence_keys.emplace_back(&occurrence);
-        return binary::CreateOccurrenceEntry(builder,
-                                             safe_cast<binary::Occurrence>(&occurrence),
-                                             CreateVector(builder, buffer));
-    });
-    ranges::sort(views::zip(occurrence_keys, occurrences), refl::less, [](auto e) -> auto& {
-        return *std::get<0>(e);
-    });
+    /// Merge the sorted occurrences of base and delta.
+    auto& delta_occurrences = index->occurrences;
+    BaseOccurrences base_occurrences(base);
+    llvm::SmallVector<Occurrence, 0> occurrences;
+    llvm::SmallVector<std::uint32_t, 0> occurrence_contexts;
+    occurrences.reserve(base_occurrences.size() + delta_occurrences.size());
+    occurrence_contexts.reserve(occurrences.capacity());
+
+    for(std::size_t i = 0, j = 0; i < base_occurrences.size() || j < delta_occurrences.size();) {
+        if(j == delta_occurrences.size() ||
+           (i < base_occurrences.size() &&
+            refl::less(base_occurrences[i], delta_occurrences[j]))) {
+            occurrences.emplace_back(base_occurrences[i]);
+            occurrence_contexts.emplace_back(contexts.copy(base, base_occurrences.contexts[i]));
+            i += 1;
+        } else if(i == base_occurrences.size() ||
+                  refl::less(delta_occurrences[j], base_occurrences[i])) {
+            occurrences.emplace_back(delta_occurrences[j]);
+            occurrence_contexts.emplace_back(contexts.write(delta_occurrences.context(j)));
+            j += 1;
+        } else {
+            auto bitmap = read_context(base, base_occurrences.contexts[i]);
+            bitmap |= delta_occurrences.context(j);
+            occurrences.emplace_back(base_occurrences[i]);
+            occurrence_contexts.emplace_back(contexts.write(bitmap));
+            i += 1;
+            j += 1;
+        }
+    }
 
-    llvm::SmallVector<std::uint64_t> relation_keys;
-    relation_keys.reserve(index->relations.size());
-    auto relations = transform(index->relations, [&](auto&& value) {
-        auto&& [symbol_id, symbol_relations] = value;
-        auto relations = transform(symbol_relations, [&](auto&& value) {
-            auto&& [relation, bitmap] = value;
-            buffer.clear();
-            buffer.resize_for_overwrite(bitmap.getSizeInBytes(false));
-            bitmap.write(buffer.data(), false);
-            return binary::CreateRelationEntry(builder,
-                                               safe_cast<binary::Relation>(&relation),
-                                               CreateVector(builder, buffer));
-        });
-        relation_keys.emplace_back(symbol_id);
-        return binary::CreateSymbolRelationsEntry(builder,
-                                                  symbol_id,
-                                                  CreateVector(builder, relations));
-    });
-    ranges::sort(views::zip(relation_keys, relations), refl::less, [](auto e) -> auto {
-        return std::get<0>(e);
-    });
+    /// Replace the targets of occurrences with their positions in the symbol
+    /// dictionary, which halves the size of the target.
+    llvm::SmallVector<SymbolHash, 0> symbols;
+    symbols.reserve(occurrences.size());
+    for(auto& occurrence: occurrences) {
+        symbols.emplace_back(occurrence.target);
+    }
+    ranges::sort(symbols);
+    symbols.erase(std::unique(symbols.begin(), symbols.end()), symbols.end());
+
+    llvm::SmallVector<OccurrenceEntry, 0> occurrence_entries;
+    occurrence_entries.reserve(occurrences.size());
+    for(auto& occurrence: occurrences) {
+        auto symbol = ranges::lower_bound(symbols, occurrence.target) - symbols.begin();
+        occurrence_entries.emplace_back(occurrence.range, static_cast<std::uint32_t>(symbol));
+    }
+
+    using RelationsEntry = decltype(index->relations)::value_type;
+    llvm::SmallVector<const RelationsEntry*> sorted_relations;
+    sorted_relations.reserve(index->relations.size());
+    for(auto& entry: index->relations) {
+        sorted_relations.emplace_back(&entry);
+    }
+    ranges::sort(sorted_relations, {}, [](auto e) { return e->first; });
+
+    using DeltaRelation = RelationsEntry::second_type::value_type;
+    llvm::SmallVector<const DeltaRelation*> symbol_relations;
+    llvm::SmallVector<RelationEntry, 0> relation_entries;
+
+    /// Merge the sorted relations of one symbol in base and delta, either of
+    /// them could be empty.
+    auto merge_relations = [&](llvm::ArrayRef<RelationEntry> base_relations,
+                               const RelationsEntry* delta) {
+        symbol_relations.clear();
+        if(delta) {
+            for(auto& relation: delta->second) {
+                symbol_relations.emplace_back(&relation);
+            }
+            ranges::sort(symbol_relations, refl::less, [](auto e) -> auto& { return e->first; });
+        }
+
+        relation_entries.clear();
+        for(std::size_t i = 0, j = 0; i < base_relations.size() || j < symbol_relations.size();) {
+            if(j == symbol_relations.size() ||
+               (i < base_relations.size() &&
+                refl::less(base_relations[i].relation, symbol_relations[j]->first))) {
+                auto& entry = base_relations[i];
+                relation_entries.emplace_back(entry.relation, contexts.copy(base, entry.context));
+                i += 1;
+            } else if(i == base_relations.size() ||
+                      refl::less(symbol_relations[j]->first, base_relations[i].relation)) {
+                auto& [relation, context] = *symbol_relations[j];
+                relation_entries.emplace_back(relation, contexts.write(context));
+                j += 1;
+            } else {
+                auto& entry = base_relations[i];
+                auto bitmap = read_context(base, entry.context);
+                bitmap |= symbol_relations[j]->second;
+                relation_entries.emplace_back(entry.relation, contexts.write(bitmap));
+                i += 1;
+                j += 1;
+            }
+        }
+
+        return binary::CreateSymbolRelationsEntry(
+            builder,
+            CreateStructVector<binary::RelationEntry>(builder, relation_entries));
+    };
+
+    /// Merge the sorted symbols of base and delta.
+    auto base_symbols = as_array(base ? base->relation_symbols() : nullptr);
+    llvm::SmallVector<SymbolHash, 0> relation_symbols;
+    Offsets<binary::SymbolRelationsEntry> relations;
+    relation_symbols.reserve(base_symbols.size() + sorted_relations.size());
+    relations.reserve(relation_symbols.capacity());
+
+    for(std::size_t i = 0, j = 0; i < base_symbols.size() || j < sorted_relations.size();) {
+        if(j == sorted_relations.size() ||
+           (i < base_symbols.size() && base_symbols[i] < sorted_relations[j]->first)) {
+            relation_symbols.emplace_back(base_symbols[i]);
+            relations.emplace_back(merge_relations(relations_of(base, i), nullptr));
+            i += 1;
+        } else if(i == base_symbols.size() || sorted_relations[j]->first < base_symbols[i]) {
+            relation_symbols.emplace_back(sorted_relations[j]->first);
+            relations.emplace_back(merge_relations({}, sorted_relations[j]));
+            j += 1;
+        } else {
+            relation_symbols.emplace_back(base_symbols[i]);
+            relations.emplace_back(merge_relations(relations_of(base, i), sorted_relations[j]));
+            i += 1;
+            j += 1;
+        }
+    }
+
+    /// Merge the reverse relations of base and delta, they are small enough to
+    /// be sorted as a whole.
+    llvm::SmallVector<ReverseRelation, 0> reverse_relations;
+    if(base) {
+        ranges::copy(as_array<ReverseRelation>(base->reverse_relations()),
+                     std::back_inserter(reverse_relations));
+    }
+    for(auto& [target, sources]: index->reverse_relations) {
+        for(auto source: sources) {
+            reverse_relations.emplace_back(target, source);
+        }
+    }
+    ranges::sort(reverse_relations);
+    reverse_relations.erase(std::unique(reverse_relations.begin(), reverse_relations.end()),
+                            reverse_relations.end());
+
+    LineTableRef lines = index->lines;
+    if(lines.empty() && base) {
+        lines.line_starts = as_array(base->line_starts());
+        lines.wide_chars = as_array<WideChar>(base->wide_chars());
+    }
+    auto line_starts_vector = CreateVector(builder, lines.line_starts);
+    auto wide_chars_vector = CreateStructVector<binary::WideChar>(builder, lines.wide_chars);
+
+    auto canonical_cache_vector = CreateStructVector<binary::CacheEntry>(builder, canonical_cache);
+    auto header_contexts_vector = CreateVector(builder, header_contexts);
+    auto compilation_contexts_vector = CreateVector(builder, compilation_contexts);
+    auto occurrence_contexts_vector = CreateVector(builder, occurrence_contexts);
+    auto context_bitmaps_vector = contexts.finish();
+    auto relations_vector = CreateVector(builder, relations);
+
+    /// The arrays used by binary search are created last. Flatbuffers builds the
+    /// buffer from back to front, so they are placed together at the beginning of
+    /// the file, right after the root table.
+    llvm::SmallVector<std::uint32_t, 0> occurrence_max_ends;
+    build_max_ends(
+        occurrences.size(),
+        [&](std::size_t i) { return occurrences[i].range.end; },
+        occurrence_max_ends);
+    auto occurrence_max_ends_vector = CreateVector(builder, occurrence_max_ends);
+    auto occurrences_vector =
+        CreateStructVector<binary::OccurrenceEntry>(builder, occurrence_entries);
+    auto symbols_vector = CreateVector(builder, symbols);
+    auto relation_symbols_vector = CreateVector(builder, relation_symbols);
+    auto reverse_relations_vector =
+        CreateStructVector<binary::ReverseRelation>(builder, reverse_relations);
 
     auto merged_index = binary::CreateMergedIndex(builder,
                                                   index->max_canonical_id,
-                                                  CreateVector(builder, canonical_cache),
-                                                  CreateVector(builder, header_contexts),
-                                                  CreateVector(builder, compilation_contexts),
-                                                  CreateVector(builder, occurrences),
-                                                  CreateVector(builder, relations));
-    builder.Finish(merged_index);
+                                                  canonical_cache_vector,
+                                                  header_contexts_vector,
+                                                  compilation_contexts_vector,
+                                                  occurrences_vector,
+                                                  symbols_vector,
+                                                  occurrence_contexts_vector,
+                                                  context_bitmaps_vector,
+                                                  occurrence_max_ends_vector,
+                                                  relation_symbols_vector,
+                                                  relations_vector,
+                                                  line_starts_vector,
+                                                  wide_chars_vector,
+                                                  reverse_relations_vector,
+                                                  merged_index_format);
+    builder.Finish(merged_index, merged_index_identifier);
 
     out.write(safe_cast<char>(builder.GetBufferPointer()), builder.GetSize());
 }
@@ -344,53 +1334,34 @@ void MergedIndex::serialize(this const Self& self, llvm::raw_ostream& out) {
 void MergedIndex::lookup(this const Self& self,
                          std::uint32_t offset,
                          llvm::function_ref<bool(const Occurrence&)> callback) {
-    if(self.impl) {
-        auto& index = *self.impl;
-        auto& occurrences = index.occurrences_cache;
-        if(occurrences.empty()) {
-            for(auto& [o, _]: index.occurrences) {
-                occurrences.emplace_back(o);
-            }
-            ranges::sort(occurrences, refl::less);
-        }
-
-        auto it = ranges::lower_bound(occurrences, offset, {}, [](index::Occurrence& o) {
-            return o.range.end;
-        });
-
-        while(it != occurrences.end()) {
-            if(it->range.contains(offset)) {
-                if(!callback(*it)) {
-                    break;
-                }
-
-                it++;
-                continue;
-            }
+    /// The occurrences reported from base, the same ones in delta are skipped.
+    llvm::SmallVector<Occurrence, 4> reported;
 
-            break;
-        }
-    } else if(self.buffer) {
+    if(self.buffer) {
         auto index = fbs::GetRoot<binary::MergedIndex>(self.buffer->getBufferStart());
-        auto& occurrences = *index->occurrences();
+        BaseOccurrences occurrences(index);
+        auto max_ends = as_array(index->occurrence_max_ends());
+
+        bool finished = stab(
+            occurrences.size(),
+            offset,
+            [&](std::size_t i) { return occurrences.entries[i].range.begin; },
+            [&](std::size_t i) { return occurrences.entries[i].range.end; },
+            [&](std::size_t i) { return max_ends[i]; },
+            [&](std::size_t i) {
+                auto occurrence = occurrences[i];
+                reported.emplace_back(occurrence);
+                return callback(occurrence);
+            });
+        if(!finished) {
+            return;
+        }
+    }
 
-        auto it = ranges::lower_bound(occurrences, offset, {}, [](auto o) {
-            return o->occurrence()->range().end();
+    if(self.impl) {
+        self.impl->occurrences.lookup(offset, [&](const Occurrence& occurrence) {
+            return llvm::is_contained(reported, occurrence) || callback(occurrence);
         });
-
-        while(it != occurrences.end()) {
-            auto o = safe_cast<Occurrence>(it->occurrence());
-            if(o->range.contains(offset)) {
-                if(!callback(*o)) {
-                    break;
-                }
-
-                it++;
-                continue;
-            }
-
-            break;
-        }
     }
 }
 
@@ -398,6 +1369,26 @@ void MergedIndex::lookup(this const Self& self,
                          SymbolHash symbol,
                          RelationKind kind,
                          llvm::function_ref<bool(const Relation&)> callback) {
+    /// The relations of the symbol in base, the same ones in delta are skipped.
+    llvm::ArrayRef<RelationEntry> base_relations;
+
+    if(self.buffer) {
+        auto index = fbs::GetRoot<binary::MergedIndex>(self.buffer->getBufferStart());
+        auto symbols = as_array(index->relation_symbols());
+
+        auto it = ranges::lower_bound(symbols, symbol);
+        if(it != symbols.end() && *it == symbol) {
+            base_relations = relations_of(index, std::distance(symbols.begin(), it));
+            for(auto& entry: base_relations) {
+                auto& r = entry.relation;
+                if(r.kind & kind) {
+                    if(!callback(r)) {
+                        return;
+                    }
+                }
+            }
+        }
+    }
 
     if(self.impl) {
         auto it = self.impl->relations.find(symbol);
@@ -408,57 +1399,120 @@ void MergedIndex::lookup(this const Self& self,
         auto& relations = it->second;
         for(auto& [relation, _]: relations) {
             if(relation.kind & kind) {
+                if(contains(base_relations, relation)) {
+                    continue;
+                }
+
                 if(!callback(relation)) {
-                    break;
+                    return;
                 }
             }
         }
-    } else if(self.buffer) {
+    }
+}
+
+void MergedIndex::reverse_lookup(
+    this const Self& self,
+    SymbolHash target,
+    RelationKind kind,
+    llvm::function_ref<bool(SymbolHash, const Relation&)> callback) {
+    /// The candidate sources of the target, base and delta may share some.
+    llvm::SmallVector<SymbolHash, 8> sources;
+
+    if(self.buffer) {
         auto index = fbs::GetRoot<binary::MergedIndex>(self.buffer->getBufferStart());
-        auto& entries = *index->relations();
+        auto entries = as_array<ReverseRelation>(index->reverse_relations());
+        auto it = ranges::lower_bound(entries, target, {}, &ReverseRelation::target);
+        for(; it != entries.end() && it->target == target; ++it) {
+            sources.emplace_back(it->source);
+        }
+    }
 
-        auto it = ranges::lower_bound(entries, symbol, {}, [](auto e) { return e->symbol(); });
-        if(it == entries.end() || it->symbol() != symbol) [[unlikely]] {
+    if(self.impl) {
+        auto it = self.impl->reverse_relations.find(target);
+        if(it != self.impl->reverse_relations.end()) {
+            sources.append(it->second.begin(), it->second.end());
+        }
+    }
+
+    ranges::sort(sources);
+    sources.erase(std::unique(sources.begin(), sources.end()), sources.end());
+
+    /// The relations themselves are stored with their sources, and a source may
+    /// have relations of other kinds to the target.
+    for(auto source: sources) {
+        bool finished = true;
+        self.lookup(source, kind, [&](const Relation& relation) {
+            if(relation.target_symbol != target) {
+                return true;
+            }
+
+            finished = callback(source, relation);
+            return finished;
+        });
+
+        if(!finished) {
             return;
         }
+    }
+}
 
-        for(auto entry: *it->relations()) {
-            auto r = safe_cast<Relation>(entry->relation());
-            if(r->kind & kind) {
-                if(!callback(*r)) {
-                    break;
-                }
+LineTableRef MergedIndex::lines(this const Self& self) {
+    if(self.impl && !self.impl->lines.empty()) {
+        return self.impl->lines;
+    }
+
+    if(self.buffer) {
+        auto index = fbs::GetRoot<binary::MergedIndex>(self.buffer->getBufferStart());
+        return LineTableRef{
+            as_array(index->line_starts()),
+            as_array<WideChar>(index->wide_chars()),
+        };
+    }
+
+    return LineTableRef{};
+}
+
+void MergedIndex::includers(this const Self& self,
+                            llvm::function_ref<void(std::uint32_t)> callback) {
+    if(self.impl) {
+        for(auto& [path_id, context]: self.impl->header_contexts) {
+            if(!context.includes.empty()) {
+                callback(path_id);
+            }
+        }
+    } else if(self.buffer) {
+        auto index = fbs::GetRoot<binary::MergedIndex>(self.buffer->getBufferStart());
+        for(auto entry: *index->header_contexts()) {
+            if(entry->includes()->size() != 0) {
+                callback(entry->path_id());
             }
         }
     }
 }
 
-bool MergedIndex::need_update(this const Self& self, llvm::ArrayRef<llvm::StringRef> path_mapping) {
+bool MergedIndex::need_update(
+    this const Self& self,
+    llvm::function_ref<std::optional<std::int64_t>(std::uint32_t)> modified_time,
+    llvm::function_ref<std::optional<std::uint64_t>(std::uint32_t)> content_hash) {
+    /// The source file and all files it includes, each file is checked once.
+    std::uint32_t source = -1;
+    std::int64_t build_at = 0;
+    llvm::SmallVector<std::uint32_t> deps;
+    llvm::ArrayRef<DependencyHash> dependencies;
+
     if(self.impl) {
         if(self.impl->compilation_contexts.empty()) {
             return true;
         }
 
-        auto& context = self.impl->compilation_contexts.begin()->getSecond();
-
-        llvm::DenseSet<std::uint32_t> deps;
+        auto& [path_id, context] = *self.impl->compilation_contexts.begin();
+        source = path_id;
+        build_at = context.build_at;
+        dependencies = context.dependencies;
         for(auto& location: context.include_locations) {
-            auto [_, success] = deps.insert(location.path_id);
-            if(success) {
-                fs::file_status status;
-                if(auto err = fs::status(path_mapping[location.path_id], status)) {
-                    return true;
-                }
-
-                auto time = std::chrono::duration_cast<std::chrono::milliseconds>(
-                    status.getLastModificationTime().time_since_epoch());
-                if(time.count() > context.build_at) {
-                    return true;
-                }
-            }
+            deps.emplace_back(location.path_id);
         }
-
-        return false;
     } else if(self.buffer) {
         auto index = fbs::GetRoot<binary::MergedIndex>(self.buffer->getBufferStart());
         if(index->compilation_contexts()->empty()) {
@@ -466,43 +1520,171 @@ bool MergedIndex::need_update(this const Self& self, llvm::ArrayRef<llvm::String
         }
 
         auto context = *index->compilation_contexts()->begin();
-
-        llvm::DenseSet<std::uint32_t> deps;
+        source = context->path_id();
+        build_at = context->build_at();
+        dependencies = as_array<DependencyHash>(context->dependencies());
         for(auto location: *context->include_locations()) {
-            auto [_, success] = deps.insert(location->path_id());
-            if(success) {
-                fs::file_status status;
-                if(auto err = fs::status(path_mapping[location->path_id()], status)) {
-                    return true;
-                }
+            deps.emplace_back(location->path_id());
+        }
+    } else {
+        return true;
+    }
 
-                auto time = std::chrono::duration_cast<std::chrono::milliseconds>(
-                    status.getLastModificationTime().time_since_epoch());
-                if(time.count() > context->build_at()) {
-                    return true;
-                }
+    deps.emplace_back(source);
+    ranges::sort(deps);
+    deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+
+    for(auto path_id: deps) {
+        auto time = modified_time(path_id);
+        if(!time) {
+            return true;
+        }
+
+        /// The modification time is a fast filter, a file touched without
+        /// changing its content, e.g. by switching branches, is unchanged.
+        if(*time <= build_at) {
+            continue;
+        }
+
+        if(!content_hash) {
+            return true;
+        }
+
+        auto it = ranges::lower_bound(dependencies, path_id, {}, &DependencyHash::path_id);
+        if(it == dependencies.end() || it->path_id != path_id) {
+            return true;
+        }
+
+        auto hash = content_hash(path_id);
+        if(!hash || *hash != it->hash) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+std::size_t MergedIndex::memory_usage(this const Self& self) {
+    std::size_t size = 0;
+
+    if(self.buffer) {
+        size += self.buffer->getBufferSize();
+    }
+
+    if(self.impl) {
+        auto& index = *self.impl;
+
+        /// Most bitmaps only hold a few canonical ids, which costs about one
+        /// container allocation. Counting them exactly is too expensive.
+        constexpr std::size_t bitmap_size = 64;
+
+        size += index.lines.line_starts.capacity() * sizeof(std::uint32_t);
+        size += index.lines.wide_chars.capacity() * sizeof(WideChar);
+        size += index.header_contexts.getMemorySize();
+        size += index.compilation_contexts.getMemorySize();
+        size += index.canonical_cache.getMemorySize();
+        size += index.canonical_ref_counts.capacity() * sizeof(std::uint32_t);
+        size += index.occurrences.memory_usage() + index.occurrences.size() * bitmap_size;
+        size += index.relations.getMemorySize();
+        for(auto& [_, relations]: index.relations) {
+            size += relations.getMemorySize() + relations.size() * bitmap_size;
+        }
+        size += index.reverse_relations.getMemorySize();
+        for(auto& [_, sources]: index.reverse_relations) {
+            if(sources.capacity() > 2) {
+                size += sources.capacity() * sizeof(SymbolHash);
             }
         }
+    }
 
+    return size;
+}
+
+bool MergedIndex::need_compact(this const Self& self) {
+    if(!self.impl) {
+        return false;
+    }
+
+    auto& index = *self.impl;
+
+    /// Compact if a quarter of canonical ids are dead.
+    auto removed = index.removed.cardinality();
+    if(removed != 0 && removed * 4 >= index.max_canonical_id) {
+        return true;
+    }
+
+    auto delta = index.occurrences.size() + index.relations_count;
+    std::size_t base = 0;
+    if(self.buffer) {
+        auto root = fbs::GetRoot<binary::MergedIndex>(self.buffer->getBufferStart());
+        base = root->occurrences()->size();
+    }
+
+    return delta >= compaction_threshold && delta * 4 >= base;
+}
+
+MergedIndex MergedIndex::snapshot(this const Self& self) {
+    MergedIndex index;
+    index.buffer = self.buffer;
+    index.impl = self.impl;
+    index.dirty = self.dirty;
+    index.version = self.version;
+    return index;
+}
+
+CompactStatistics MergedIndex::compact(this Self& self) {
+    CompactStatistics stats;
+    if(!self.impl) {
+        return stats;
+    }
+
+    /// Dropping dead canonical ids needs to rewrite all bitmaps, fold the base
+    /// into memory only if there are any.
+    if(!self.impl->removed.isEmpty()) {
+        self.load_in_memory();
+        self.impl->collect_garbage(stats);
+    }
+
+    llvm::SmallString<0> data;
+    llvm::raw_svector_ostream os(data);
+    self.serialize(os);
+
+    /// The metadata lives in the new base now, it will be loaded again on
+    /// next modification.
+    self.buffer = llvm::MemoryBuffer::getMemBufferCopy(data);
+    self.impl.reset();
+    return stats;
+}
+
+bool MergedIndex::mark_written(this Self& self, const MergedIndex& written) {
+    if(self.version != written.version) {
+        return false;
+    }
+
+    self.dirty = false;
+    return true;
+}
+
+bool MergedIndex::rebase(this Self& self, MergedIndex&& compacted) {
+    /// A never modified index may have been reloaded from disk in the meantime.
+    if(self.version == 0 || self.version != compacted.version) {
         return false;
     }
 
+    self.buffer = std::move(compacted.buffer);
+    self.impl = std::move(compacted.impl);
     return true;
 }
 
 void MergedIndex::remove(this Self& self, std::uint32_t path_id) {
-    self.load_in_memory();
+    self.load_metadata();
+    self.dirty = true;
+    self.version = next_version.fetch_add(1, std::memory_order_relaxed);
     auto& index = *self.impl;
 
     auto& includes = index.header_contexts[path_id].includes;
-
     for(auto& [_, canonical_id]: includes) {
-        auto& ref_counts = index.canonical_ref_counts[canonical_id];
-        ref_counts -= 1;
-
-        if(ref_counts == 0) {
-            index.removed.add(canonical_id);
-        }
+        index.release(canonical_id);
     }
 
     includes.clear();
@@ -512,27 +1694,86 @@ void MergedIndex::merge(this Self& self,
                         std::uint32_t path_id,
                         std::chrono::milliseconds build_at,
                         std::vector<IncludeLocation> include_locations,
-                        FileIndex& index) {
-    self.load_in_memory();
+                        FileIndex& index,
+                        std::vector<DependencyHash> dependencies) {
+    self.load_metadata();
+    self.dirty = true;
+    self.version = next_version.fetch_add(1, std::memory_order_relaxed);
     self.impl->merge(path_id, index, [&](Impl& self, std::uint32_t canonical_id) {
-        auto& context = self.compilation_contexts[path_id];
+        /// The new compilation context replaces the old one.
+        auto [it, inserted] = self.compilation_contexts.try_emplace(path_id);
+        if(!inserted) {
+            self.release(it->second.canonical_id);
+        }
+
+        auto& context = it->second;
         context.canonical_id = canonical_id;
         context.build_at = build_at.count();
         context.include_locations = std::move(include_locations);
+        context.dependencies = std::move(dependencies);
+        ranges::sort(context.dependencies, {}, &DependencyHash::path_id);
     });
 }
 
-void MergedIndex::merge(this Self& self,
-                        std::uint32_t path_id,
-                        std::uint32_t include_id,
-                        FileIndex& index) {
-    self.load_in_memory();
-    self.impl->merge(path_id, index, [&](Impl& self, std::uint32_t canonical_id) {
+IndexHash MergedIndex::merge(this Self& self,
+                             std::uint32_t path_id,
+                             std::uint32_t include_id,
+                             FileIndex& index) {
+    self.load_metadata();
+    self.dirty = true;
+    self.version = next_version.fetch_add(1, std::memory_order_relaxed);
+    return self.impl->merge(path_id, index, [&](Impl& self, std::uint32_t canonical_id) {
         auto& context = self.header_contexts[path_id];
         context.includes.emplace_back(include_id, canonical_id);
     });
 }
 
+llvm::SmallVector<IndexHash> MergedIndex::merge_batch(this Self& self,
+                                                      llvm::ArrayRef<PendingHeader> headers) {
+    llvm::SmallVector<IndexHash> hashes(headers.size());
+    if(headers.empty()) {
+        return hashes;
+    }
+
+    self.load_metadata();
+    self.dirty = true;
+    self.version = next_version.fetch_add(1, std::memory_order_relaxed);
+
+    llvm::SmallVector<FileIndex*> indices;
+    indices.reserve(headers.size());
+    for(auto& header: headers) {
+        indices.emplace_back(header.index);
+    }
+
+    self.impl->merge_batch(indices, hashes, [&](Impl& self, std::size_t i, std::uint32_t id) {
+        auto& context = self.header_contexts[headers[i].path_id];
+        context.includes.emplace_back(headers[i].include_id, id);
+    });
+    return hashes;
+}
+
+bool MergedIndex::merge(this Self& self,
+                        std::uint32_t path_id,
+                        std::uint32_t include_id,
+                        const IndexHash& hash) {
+    self.load_metadata();
+    auto& index = *self.impl;
+
+    auto it = index.canonical_cache.find(hash);
+    if(it == index.canonical_cache.end()) {
+        return false;
+    }
+
+    self.dirty = true;
+    self.version = next_version.fetch_add(1, std::memory_order_relaxed);
+
+    auto canonical_id = it->second;
+    index.canonical_ref_counts[canonical_id] += 1;
+    index.removed.remove(canonical_id);
+    index.header_contexts[path_id].includes.emplace_back(include_id, canonical_id);
+    return true;
+}
+
 bool operator== (MergedIndex& lhs, MergedIndex& rhs) {
     lhs.load_in_memory();
     rhs.load_in_memory();
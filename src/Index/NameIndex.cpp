@@ -0,0 +1,375 @@
+#include <queue>
+#include <numeric>
+#include <shared_mutex>
+#include "Serialization.h"
+#include "Index/NameIndex.h"
+#include "Support/FuzzyMatcher.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
+
+namespace clice::index {
+
+namespace {
+
+/// Tokens of a name. Short queries can't form a trigram, they are looked up
+/// with the unigram and bigrams at the start of the names.
+enum TokenKind : std::uint32_t {
+    Trigram = 0,
+    Unigram = 1,
+    Bigram = 2,
+};
+
+constexpr std::uint32_t token(TokenKind kind, char a, char b = 0, char c = 0) {
+    return kind << 24 | std::uint32_t(static_cast<unsigned char>(a)) << 16 |
+           std::uint32_t(static_cast<unsigned char>(b)) << 8 |
+           std::uint32_t(static_cast<unsigned char>(c));
+}
+
+/// Lowercase the characters of word segments and drop the separators. `heads`
+/// records whether each kept character starts a segment.
+void normalize(llvm::StringRef text,
+               llvm::SmallVectorImpl<char>& chars,
+               llvm::SmallVectorImpl<bool>* heads = nullptr) {
+    llvm::SmallVector<CharRole, 64> roles(text.size());
+    calculate_roles(text, roles);
+
+    for(std::size_t i = 0; i < text.size(); i++) {
+        if(roles[i] == Separator || roles[i] == Unknown) {
+            continue;
+        }
+
+        chars.emplace_back(llvm::toLower(text[i]));
+        if(heads) {
+            heads->emplace_back(roles[i] == Head);
+        }
+    }
+}
+
+/// Collect the tokens of the name. A fuzzy match may continue from a character
+/// with the next one, or jump to the next segment heads, so the trigrams are
+/// formed along these transitions, e.g. `FuzzyMatcher` has `fma` and `zma`.
+void name_tokens(llvm::StringRef name, llvm::SmallVectorImpl<std::uint32_t>& tokens) {
+    llvm::SmallString<64> chars;
+    llvm::SmallVector<bool, 64> heads;
+    normalize(name, chars, &heads);
+
+    std::uint32_t n = chars.size();
+    if(n == 0) {
+        return;
+    }
+
+    llvm::SmallVector<std::uint32_t, 64> next_head(n + 1, n);
+    for(std::uint32_t i = n; i-- > 0;) {
+        next_head[i] = i + 1 < n && heads[i + 1] ? i + 1 : next_head[i + 1];
+    }
+
+    auto successors = [&](std::uint32_t i) {
+        llvm::SmallVector<std::uint32_t, 3> result;
+        for(auto next: {i + 1, next_head[i], next_head[next_head[i]]}) {
+            if(next < n && !llvm::is_contained(result, next)) {
+                result.emplace_back(next);
+            }
+        }
+        return result;
+    };
+
+    for(std::uint32_t i = 0; i < n; i++) {
+        for(auto j: successors(i)) {
+            for(auto k: successors(j)) {
+                tokens.emplace_back(token(Trigram, chars[i], chars[j], chars[k]));
+            }
+        }
+    }
+
+    tokens.emplace_back(token(Unigram, chars[0]));
+    if(n > 1) {
+        tokens.emplace_back(token(Bigram, chars[0], chars[1]));
+        if(next_head[0] < n) {
+            tokens.emplace_back(token(Bigram, chars[0], chars[next_head[0]]));
+        }
+    }
+
+    ranges::sort(tokens);
+    tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+}
+
+/// Collect the tokens that all matched names must contain.
+void query_tokens(llvm::StringRef query, llvm::SmallVectorImpl<std::uint32_t>& tokens) {
+    llvm::SmallString<64> chars;
+    normalize(query, chars);
+
+    if(chars.size() == 1) {
+        tokens.emplace_back(token(Unigram, chars[0]));
+    } else if(chars.size() == 2) {
+        tokens.emplace_back(token(Bigram, chars[0], chars[1]));
+    } else {
+        for(std::size_t i = 0; i + 2 < chars.size(); i++) {
+            tokens.emplace_back(token(Trigram, chars[i], chars[i + 1], chars[i + 2]));
+        }
+    }
+
+    ranges::sort(tokens);
+    tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+}
+
+}  // namespace
+
+struct NameIndex::Impl {
+    mutable std::shared_mutex mutex;
+
+    llvm::BumpPtrAllocator allocator;
+
+    /// The names in insertion order, indexed by name id.
+    std::vector<llvm::StringRef> names;
+
+    llvm::DenseMap<llvm::StringRef, std::uint32_t> name_ids;
+
+    /// The symbols of each name, overloads share the same name.
+    std::vector<llvm::SmallVector<SymbolHash, 1>> symbols;
+
+    /// The name id of each symbol.
+    llvm::DenseMap<SymbolHash, std::uint32_t> symbol_names;
+
+    /// The ids of names containing each token.
+    llvm::DenseMap<std::uint32_t, Bitmap> postings;
+
+    std::uint32_t add_name(llvm::StringRef name) {
+        auto [it, success] = name_ids.try_emplace(name, names.size());
+        if(!success) {
+            return it->second;
+        }
+
+        auto data = allocator.Allocate<char>(name.size());
+        std::ranges::copy(name, data);
+        auto& [k, v] = *it;
+        k = llvm::StringRef(data, name.size());
+        names.emplace_back(k);
+        symbols.emplace_back();
+        return v;
+    }
+};
+
+NameIndex::NameIndex() : impl(std::make_unique<Impl>()) {}
+
+NameIndex::NameIndex(NameIndex&&) = default;
+
+NameIndex& NameIndex::operator= (NameIndex&&) = default;
+
+NameIndex::~NameIndex() = default;
+
+void NameIndex::insert(llvm::ArrayRef<std::pair<SymbolHash, llvm::StringRef>> symbols) {
+    llvm::SmallVector<std::uint32_t> tokens;
+
+    std::unique_lock lock(impl->mutex);
+    for(auto& [symbol, name]: symbols) {
+        if(name.empty()) {
+            continue;
+        }
+
+        auto count = impl->names.size();
+        auto id = impl->add_name(name);
+        auto& name_symbols = impl->symbols[id];
+        if(impl->symbol_names.try_emplace(symbol, id).second) {
+            name_symbols.emplace_back(symbol);
+        }
+
+        if(id < count) {
+            continue;
+        }
+
+        tokens.clear();
+        name_tokens(name, tokens);
+        for(auto token: tokens) {
+            impl->postings[token].add(id);
+        }
+    }
+}
+
+void NameIndex::search(
+    llvm::StringRef query,
+    std::size_t limit,
+    llvm::function_ref<void(SymbolHash, llvm::StringRef, float)> callback) const {
+    if(limit == 0) {
+        return;
+    }
+
+    llvm::SmallVector<std::uint32_t> tokens;
+    query_tokens(query, tokens);
+
+    /// The best names found, the worst one is on the top.
+    using Candidate = std::pair<float, std::uint32_t>;
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<>> best;
+    llvm::SmallVector<std::pair<SymbolHash, llvm::StringRef>> symbols;
+    llvm::SmallVector<float> scores;
+
+    {
+        std::shared_lock lock(impl->mutex);
+
+        auto consider = [&](std::uint32_t id, float score) {
+            if(best.size() < limit) {
+                best.emplace(score, id);
+            } else if(best.top().first < score) {
+                best.pop();
+                best.emplace(score, id);
+            }
+        };
+
+        if(tokens.empty()) {
+            for(std::uint32_t id = 0; id < impl->names.size() && best.size() < limit; id++) {
+                consider(id, 1);
+            }
+        } else {
+            /// Intersect from the shortest posting list.
+            llvm::SmallVector<const Bitmap*> lists;
+            for(auto token: tokens) {
+                auto it = impl->postings.find(token);
+                if(it == impl->postings.end()) {
+                    return;
+                }
+                lists.emplace_back(&it->second);
+            }
+            ranges::sort(lists, {}, [](const Bitmap* list) { return list->cardinality(); });
+
+            Bitmap candidates = *lists.front();
+            for(auto list: llvm::drop_begin(lists)) {
+                candidates &= *list;
+            }
+
+            FuzzyMatcher matcher(query);
+            for(auto id: candidates) {
+                if(auto score = matcher.match(impl->names[id])) {
+                    consider(id, *score);
+                }
+            }
+        }
+
+        std::vector<Candidate> sorted;
+        sorted.reserve(best.size());
+        while(!best.empty()) {
+            sorted.emplace_back(best.top());
+            best.pop();
+        }
+
+        for(auto& [score, id]: llvm::reverse(sorted)) {
+            for(auto symbol: impl->symbols[id]) {
+                if(symbols.size() == limit) {
+                    break;
+                }
+                symbols.emplace_back(symbol, impl->names[id]);
+                scores.emplace_back(score);
+            }
+        }
+    }
+
+    /// Names are never freed, they are valid after unlocking.
+    for(std::size_t i = 0; i < symbols.size(); i++) {
+        callback(symbols[i].first, symbols[i].second, scores[i]);
+    }
+}
+
+llvm::StringRef NameIndex::name(SymbolHash symbol) const {
+    std::shared_lock lock(impl->mutex);
+    auto it = impl->symbol_names.find(symbol);
+    if(it == impl->symbol_names.end()) {
+        return {};
+    }
+    return impl->names[it->second];
+}
+
+std::size_t NameIndex::size() const {
+    std::shared_lock lock(impl->mutex);
+    return impl->names.size();
+}
+
+void NameIndex::serialize(llvm::raw_ostream& os) const {
+    std::shared_lock lock(impl->mutex);
+
+    /// Sort the names and map the name ids to their ranks.
+    std::vector<std::uint32_t> order(impl->names.size());
+    std::iota(order.begin(), order.end(), 0);
+    ranges::sort(order, {}, [&](std::uint32_t id) { return impl->names[id]; });
+
+    std::vector<std::uint32_t> ranks(order.size());
+    for(std::uint32_t rank = 0; rank < order.size(); rank++) {
+        ranks[order[rank]] = rank;
+    }
+
+    std::vector<char> names;
+    std::vector<std::uint32_t> name_offsets;
+    std::vector<std::uint32_t> symbol_offsets;
+    std::vector<SymbolHash> symbols;
+    for(auto id: order) {
+        name_offsets.emplace_back(names.size());
+        symbol_offsets.emplace_back(symbols.size());
+        names.insert(names.end(), impl->names[id].begin(), impl->names[id].end());
+        symbols.insert(symbols.end(), impl->symbols[id].begin(), impl->symbols[id].end());
+    }
+    name_offsets.emplace_back(names.size());
+    symbol_offsets.emplace_back(symbols.size());
+
+    std::vector<std::uint32_t> tokens;
+    for(auto& [token, _]: impl->postings) {
+        tokens.emplace_back(token);
+    }
+    ranges::sort(tokens);
+
+    fbs::FlatBufferBuilder builder(1024);
+    llvm::SmallVector<char, 1024> buffer;
+
+    Offsets<binary::PostingEntry> postings;
+    for(auto token: tokens) {
+        Bitmap ids;
+        for(auto id: impl->postings.find(token)->second) {
+            ids.add(ranks[id]);
+        }
+        ids.runOptimize();
+        postings.emplace_back(
+            binary::CreatePostingEntry(builder, token, CreateBitmap(builder, buffer, ids)));
+    }
+
+    auto index = binary::CreateNameIndex(
+        builder,
+        builder.CreateVector(reinterpret_cast<const std::uint8_t*>(names.data()), names.size()),
+        CreateVector(builder, name_offsets),
+        CreateVector(builder, symbol_offsets),
+        CreateVector(builder, symbols),
+        CreateVector(builder, postings));
+
+    builder.Finish(index);
+    os.write(safe_cast<const char>(builder.GetBufferPointer()), builder.GetSize());
+}
+
+NameIndex NameIndex::from(const void* data) {
+    auto root = fbs::GetRoot<binary::NameIndex>(data);
+
+    NameIndex index;
+    auto& impl = *index.impl;
+
+    auto names = as_array(root->names());
+    auto name_offsets = as_array(root->name_offsets());
+    auto symbol_offsets = as_array(root->symbol_offsets());
+    auto symbols = as_array(root->symbols());
+
+    auto count = name_offsets.empty() ? 0 : name_offsets.size() - 1;
+    impl.names.reserve(count);
+    impl.symbols.reserve(count);
+    for(std::size_t i = 0; i < count; i++) {
+        llvm::StringRef name(reinterpret_cast<const char*>(names.data()) + name_offsets[i],
+                             name_offsets[i + 1] - name_offsets[i]);
+        auto id = impl.add_name(name);
+        auto name_symbols =
+            symbols.slice(symbol_offsets[i], symbol_offsets[i + 1] - symbol_offsets[i]);
+        impl.symbols[id].assign(name_symbols.begin(), name_symbols.end());
+        for(auto symbol: name_symbols) {
+            impl.symbol_names.try_emplace(symbol, id);
+        }
+    }
+
+    for(auto entry: *root->postings()) {
+        impl.postings.try_emplace(entry->trigram(), read_bitmap(entry->names()));
+    }
+
+    return index;
+}
+
+}  // namespace clice::index
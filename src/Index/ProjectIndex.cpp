@@ -1,9 +1,259 @@
+#include <array>
+#include <limits>
 #include "Serialization.h"
 #include "Index/ProjectIndex.h"
 #include "Support/Ranges.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/xxhash.h"
 
 namespace clice::index {
 
+namespace {
+
+/// Get the segment and the offset in the segment of the id.
+std::pair<std::uint32_t, std::uint64_t> locate(std::uint64_t id, std::uint64_t first_size) {
+    std::uint32_t segment = std::bit_width(id / first_size + 1) - 1;
+    return {segment, id - first_size * ((std::uint64_t(1) << segment) - 1)};
+}
+
+/// An entry of the header cache, the same layout as in binary.
+struct HeaderEntry {
+    std::uint64_t fingerprint;
+    IndexHash hash;
+};
+
+}  // namespace
+
+PathPool::PathPool() :
+    shards(std::make_unique<Shard[]>(ShardCount)),
+    segments(std::make_unique<std::atomic<Slot*>[]>(SegmentCount)),
+    next_id(std::make_unique<std::atomic<std::uint32_t>>(0)) {}
+
+PathPool::~PathPool() {
+    if(!segments) {
+        return;
+    }
+
+    for(std::size_t i = 0; i < SegmentCount; i++) {
+        delete[] segments[i].load(std::memory_order_relaxed);
+    }
+}
+
+void PathPool::publish(std::uint32_t id, const llvm::StringRef* path) {
+    auto [k, offset] = locate(id, FirstSegmentSize);
+    assert(k < SegmentCount && "too many paths");
+
+    auto segment = segments[k].load(std::memory_order_acquire);
+    if(!segment) {
+        /// Multiple threads may allocate the same segment, only one of them wins.
+        auto fresh = new Slot[FirstSegmentSize << k]();
+        if(segments[k].compare_exchange_strong(segment,
+                                               fresh,
+                                               std::memory_order_acq_rel,
+                                               std::memory_order_acquire)) {
+            segment = fresh;
+        } else {
+            delete[] fresh;
+        }
+    }
+
+    segment[offset].store(path, std::memory_order_release);
+}
+
+std::uint32_t PathPool::path_id(llvm::StringRef path) {
+    assert(!path.empty());
+
+    /// The low bits of the hash are used by the hash table in the shard.
+    auto& shard = shards[llvm::xxh3_64bits(path) >> (64 - std::countr_zero(ShardCount))];
+    std::lock_guard guard(shard.mutex);
+
+    auto [it, success] = shard.cache.try_emplace(path, 0);
+    if(!success) {
+        return it->second;
+    }
+
+    auto data = shard.allocator.Allocate<char>(path.size() + 1);
+    std::ranges::copy(path, data);
+    data[path.size()] = '\0';
+    auto saved = new (shard.allocator.Allocate<llvm::StringRef>())
+        llvm::StringRef(data, path.size());
+
+    auto id = next_id->fetch_add(1, std::memory_order_acq_rel);
+    auto& [k, v] = *it;
+    k = *saved;
+    v = id;
+    publish(id, saved);
+    return id;
+}
+
+llvm::StringRef PathPool::path(std::uint32_t id) const {
+    auto [k, offset] = locate(id, FirstSegmentSize);
+    auto segment = segments[k].load(std::memory_order_acquire);
+    if(!segment) {
+        return {};
+    }
+
+    auto path = segment[offset].load(std::memory_order_acquire);
+    return path ? *path : llvm::StringRef();
+}
+
+void PathPool::insert(std::uint32_t id, llvm::StringRef path) {
+    auto& shard = shards[llvm::xxh3_64bits(path) >> (64 - std::countr_zero(ShardCount))];
+    auto saved = new (shard.allocator.Allocate<llvm::StringRef>()) llvm::StringRef(path);
+
+    shard.cache.try_emplace(*saved, id);
+    publish(id, saved);
+    if(id >= next_id->load(std::memory_order_relaxed)) {
+        next_id->store(id + 1, std::memory_order_release);
+    }
+}
+
+ShardedSymbolTable::ShardedSymbolTable() : shards(std::make_unique<Shard[]>(ShardCount)) {}
+
+void ShardedSymbolTable::load(llvm::ArrayRef<SymbolHash> ids, Decoder decoder) {
+    this->decoder = std::move(decoder);
+
+    std::size_t begin = 0;
+    for(std::size_t i = 0; i < ShardCount; i++) {
+        std::size_t end = ids.size();
+        if(i + 1 < ShardCount) {
+            end = ranges::lower_bound(ids, SymbolHash(i + 1) << ShardShift) - ids.begin();
+        }
+
+        auto& shard = shards[i];
+        std::lock_guard guard(shard.mutex);
+        shard.loaded = ids.slice(begin, end - begin);
+        shard.loaded_offset = begin;
+        shard.decoded = 0;
+        begin = end;
+    }
+}
+
+Symbol* ShardedSymbolTable::find(Shard& shard, SymbolHash id) const {
+    if(auto it = shard.symbols.find(id); it != shard.symbols.end()) {
+        return &it->second;
+    }
+
+    auto it = ranges::lower_bound(shard.loaded, id);
+    if(it == shard.loaded.end() || *it != id) {
+        return nullptr;
+    }
+
+    auto& symbol = shard.symbols[id];
+    symbol = decoder(shard.loaded_offset + (it - shard.loaded.begin()));
+    shard.decoded += 1;
+    return &symbol;
+}
+
+void ShardedSymbolTable::update(SymbolHash id, llvm::function_ref<void(Symbol&)> callback) {
+    auto& shard = shards[shard_of(id)];
+    std::lock_guard guard(shard.mutex);
+    auto symbol = find(shard, id);
+    callback(symbol ? *symbol : shard.symbols[id]);
+}
+
+void ShardedSymbolTable::merge(
+    const SymbolTable& symbols,
+    llvm::function_ref<void(SymbolHash, Symbol& target, const Symbol& source)> callback) {
+    /// Group the symbols by shard first, so that every shard is locked once.
+    std::array<llvm::SmallVector<const SymbolTable::value_type*>, ShardCount> groups;
+    for(auto& entry: symbols) {
+        groups[shard_of(entry.first)].emplace_back(&entry);
+    }
+
+    for(std::size_t i = 0; i < ShardCount; i++) {
+        if(groups[i].empty()) {
+            continue;
+        }
+
+        auto& shard = shards[i];
+        std::lock_guard guard(shard.mutex);
+        for(auto entry: groups[i]) {
+            auto symbol = find(shard, entry->first);
+            callback(entry->first, symbol ? *symbol : shard.symbols[entry->first], entry->second);
+        }
+    }
+}
+
+bool ShardedSymbolTable::lookup(SymbolHash id,
+                                llvm::function_ref<void(const Symbol&)> callback) const {
+    auto& shard = shards[shard_of(id)];
+    std::lock_guard guard(shard.mutex);
+    auto symbol = find(shard, id);
+    if(!symbol) {
+        return false;
+    }
+
+    callback(*symbol);
+    return true;
+}
+
+void ShardedSymbolTable::for_each(
+    llvm::function_ref<void(SymbolHash, const Symbol&)> callback) const {
+    for(std::size_t i = 0; i < ShardCount; i++) {
+        auto& shard = shards[i];
+        std::lock_guard guard(shard.mutex);
+        for(auto& [symbol_id, symbol]: shard.symbols) {
+            callback(symbol_id, symbol);
+        }
+
+        /// The loaded symbols never accessed are decoded temporarily.
+        if(shard.decoded == shard.loaded.size()) {
+            continue;
+        }
+
+        for(std::size_t j = 0; j < shard.loaded.size(); j++) {
+            if(!shard.symbols.contains(shard.loaded[j])) {
+                callback(shard.loaded[j], decoder(shard.loaded_offset + j));
+            }
+        }
+    }
+}
+
+std::size_t ShardedSymbolTable::size() const {
+    std::size_t size = 0;
+    for(std::size_t i = 0; i < ShardCount; i++) {
+        std::lock_guard guard(shards[i].mutex);
+        size += shards[i].symbols.size() + shards[i].loaded.size() - shards[i].decoded;
+    }
+    return size;
+}
+
+HeaderCache::HeaderCache() : state(std::make_unique<State>()) {}
+
+bool HeaderCache::contains(std::uint64_t fingerprint) const {
+    std::lock_guard guard(state->mutex);
+    return state->hashes.contains(fingerprint);
+}
+
+std::optional<IndexHash> HeaderCache::lookup(std::uint64_t fingerprint) const {
+    std::lock_guard guard(state->mutex);
+    auto it = state->hashes.find(fingerprint);
+    if(it == state->hashes.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+void HeaderCache::insert(std::uint64_t fingerprint, const IndexHash& hash) {
+    std::lock_guard guard(state->mutex);
+    state->hashes[fingerprint] = hash;
+}
+
+void HeaderCache::erase(std::uint64_t fingerprint) {
+    std::lock_guard guard(state->mutex);
+    state->hashes.erase(fingerprint);
+}
+
+void HeaderCache::for_each(
+    llvm::function_ref<void(std::uint64_t, const IndexHash&)> callback) const {
+    std::lock_guard guard(state->mutex);
+    for(auto& [fingerprint, hash]: state->hashes) {
+        callback(fingerprint, hash);
+    }
+}
+
 llvm::SmallVector<std::uint32_t> ProjectIndex::merge(this ProjectIndex& self, TUIndex& index) {
     auto& paths = index.graph.paths;
     llvm::SmallVector<std::uint32_t> file_ids_map;
@@ -13,52 +263,87 @@ llvm::SmallVector<std::uint32_t> ProjectIndex::merge(this ProjectIndex& self, TU
         file_ids_map[i] = self.path_pool.path_id(paths[i]);
     }
 
-    for(auto& [symbol_id, symbol]: index.symbols) {
-        auto& target_symbol = self.symbols[symbol_id];
-        for(auto ref: symbol.reference_files) {
-            target_symbol.reference_files.add(file_ids_map[ref]);
+    /// Only the names of new symbols need to be indexed.
+    llvm::SmallVector<std::pair<SymbolHash, llvm::StringRef>> new_symbols;
+    auto merge = [&](SymbolHash symbol_id, Symbol& target, const Symbol& source) {
+        if(target.reference_files.isEmpty()) {
+            new_symbols.emplace_back(symbol_id, source.name);
         }
-    }
+        target.kind = source.kind;
+        for(auto ref: source.reference_files) {
+            target.reference_files.add(file_ids_map[ref]);
+        }
+    };
+    self.symbols.merge(index.symbols, merge);
+    self.names().insert(new_symbols);
 
     return file_ids_map;
 }
 
+NameIndex& ProjectIndex::names(this ProjectIndex& self) {
+    auto& names = *self.lazy_names;
+    std::call_once(names.flag, [&names] {
+        if(names.data) {
+            names.index = NameIndex::from(names.data);
+            names.data = nullptr;
+        }
+    });
+    return names.index;
+}
+
 void ProjectIndex::serialize(this ProjectIndex& self, llvm::raw_ostream& os) {
     fbs::FlatBufferBuilder builder(1024);
 
     llvm::SmallVector<char, 1024> buffer;
 
-    auto i = 0;
-    auto paths = transform(self.path_pool.paths, [&](llvm::StringRef path) {
-        auto entry =
-            binary::CreatePathEntry(builder, CreateString(builder, self.path_pool.paths[i]), i);
-        i += 1;
-        return entry;
-    });
+    Offsets<binary::PathEntry> paths;
+    for(std::uint32_t i = 0, size = self.path_pool.size(); i < size; i++) {
+        paths.emplace_back(
+            binary::CreatePathEntry(builder, CreateString(builder, self.path_pool.path(i)), i));
+    }
 
     auto indices = transform(self.indices, [&](auto&& value) {
         auto&& [source, index] = value;
         return binary::PathMapEntry(source, index);
     });
 
-    auto symbols = transform(self.symbols, [&](auto&& value) {
-        auto& [symbol_id, symbol] = value;
+    /// Symbols are sorted by their ids so that they could be found without
+    /// decoding all of them when loading.
+    llvm::SmallVector<std::pair<SymbolHash, fbs::Offset<binary::Symbol>>, 0> symbols;
+    symbols.reserve(self.symbols.size());
+    self.symbols.for_each([&](SymbolHash symbol_id, const Symbol& symbol) {
+        symbols.emplace_back(
+            symbol_id,
+            binary::CreateSymbol(builder,
+                                 symbol.kind.value(),
+                                 CreateBitmap(builder, buffer, symbol.reference_files)));
+    });
+    ranges::sort(symbols, {}, [](auto& entry) { return entry.first; });
 
-        buffer.clear();
-        buffer.resize_for_overwrite(symbol.reference_files.getSizeInBytes(false));
-        symbol.reference_files.write(buffer.data(), false);
+    auto symbol_ids = CreateVector(builder, llvm::to_vector(llvm::make_first_range(symbols)));
+    auto symbol_tables = CreateVector(builder, llvm::to_vector(llvm::make_second_range(symbols)));
 
-        return binary::CreateSymbolEntry(
-            builder,
-            symbol_id,
-            binary::CreateSymbol(builder, symbol.kind.value(), CreateVector(builder, buffer)));
+    /// The name index is a nested buffer, align it for reading in place.
+    llvm::SmallString<0> name_index;
+    llvm::raw_svector_ostream name_os(name_index);
+    self.names().serialize(name_os);
+    builder.ForceVectorAlignment(name_index.size(), sizeof(std::uint8_t), alignof(std::uint64_t));
+    auto names = builder.CreateVector(reinterpret_cast<const std::uint8_t*>(name_index.data()),
+                                      name_index.size());
+
+    llvm::SmallVector<HeaderEntry, 0> headers;
+    self.headers.for_each([&](std::uint64_t fingerprint, const IndexHash& hash) {
+        headers.emplace_back(fingerprint, hash);
     });
 
     auto project_index =
         binary::CreateProjectIndex(builder,
                                    CreateVector(builder, paths),
                                    CreateStructVector<binary::PathMapEntry>(builder, indices),
-                                   CreateVector(builder, symbols));
+                                   symbol_ids,
+                                   symbol_tables,
+                                   names,
+                                   CreateStructVector<binary::HeaderEntry>(builder, headers));
 
     builder.Finish(project_index);
     os.write(safe_cast<const char>(builder.GetBufferPointer()), builder.GetSize());
@@ -69,24 +354,71 @@ ProjectIndex ProjectIndex::from(const void* data) {
 
     ProjectIndex index;
 
-    auto& pool = index.path_pool;
-    pool.paths.resize(root->paths()->size());
     for(auto entry: *root->paths()) {
-        auto k = pool.save(entry->path()->string_view());
-        pool.paths[entry->id()] = k;
-        pool.cache.try_emplace(k, entry->id());
+        /// The path whose id was being allocated when saving.
+        if(entry->path()->size() == 0) {
+            continue;
+        }
+        index.path_pool.insert(entry->id(), entry->path()->string_view());
     }
 
     for(auto entry: *root->indices()) {
         index.indices.try_emplace(entry->source(), entry->index());
     }
 
-    for(auto entry: *root->symbols()) {
-        auto& symbol = index.symbols[entry->symbol_id()];
-        symbol.kind = SymbolKind(entry->symbol()->kind());
-        symbol.reference_files = read_bitmap(entry->symbol()->refs());
+    auto symbols = root->symbols();
+    index.symbols.load(as_array(root->symbol_ids()), [symbols](std::size_t i) {
+        auto symbol = symbols->Get(i);
+        return Symbol{
+            .kind = SymbolKind(symbol->kind()),
+            .reference_files = read_bitmap(symbol->refs()),
+        };
+    });
+
+    if(auto names = root->names(); names && names->size() != 0) {
+        index.lazy_names->data = names->data();
+    }
+
+    for(auto& entry: as_array<HeaderEntry>(root->headers())) {
+        index.headers.insert(entry.fingerprint, entry.hash);
+    }
+
+    return index;
+}
+
+std::expected<ProjectIndex, std::string> ProjectIndex::load(llvm::StringRef path) {
+    /// Map the file if it is large enough, the data is aligned for reading in place.
+    auto buffer = llvm::MemoryBuffer::getFile(path,
+                                              /*IsText=*/false,
+                                              /*RequiresNullTerminator=*/false,
+                                              /*IsVolatile=*/false,
+                                              llvm::Align(alignof(std::uint64_t)));
+    if(!buffer) {
+        return std::unexpected(buffer.getError().message());
+    }
+
+    auto data = reinterpret_cast<const std::uint8_t*>((*buffer)->getBufferStart());
+    auto size = (*buffer)->getBufferSize();
+
+    /// Every symbol is a table, don't limit the count of tables.
+    fbs::Verifier::Options options;
+    options.max_tables = std::numeric_limits<fbs::uoffset_t>::max();
+    fbs::Verifier verifier(data, size, options);
+    if(size == 0 || !verifier.VerifyBuffer<binary::ProjectIndex>(nullptr)) {
+        return std::unexpected("the file is corrupted");
+    }
+
+    /// Files written by older versions may lack the sorted symbol ids.
+    auto root = fbs::GetRoot<binary::ProjectIndex>(data);
+    auto symbol_ids = as_array(root->symbol_ids());
+    auto symbols = root->symbols();
+    if(!root->paths() || !root->indices() || (symbols ? symbols->size() : 0) != symbol_ids.size() ||
+       !ranges::is_sorted(symbol_ids)) {
+        return std::unexpected("the file is written by an incompatible version");
     }
 
+    auto index = from(data);
+    index.buffer = std::move(*buffer);
     return index;
 }
 
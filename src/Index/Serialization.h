@@ -1,6 +1,7 @@
 #include "schema_generated.h"
 #include "Support/Bitmap.h"
 #include "Support/Ranges.h"
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ADT/SmallVector.h"
 
@@ -58,10 +59,40 @@ auto transform(const Range& range, const Functor& functor) {
     return result;
 }
 
+auto CreateBitmap(fbs::FlatBufferBuilder& builder,
+                  llvm::SmallVector<char, 1024>& buffer,
+                  const Bitmap& bitmap) {
+    buffer.clear();
+    buffer.resize_for_overwrite(bitmap.getSizeInBytes(false));
+    bitmap.write(buffer.data(), false);
+    return CreateVector(builder, buffer);
+}
+
 Bitmap read_bitmap(const fbs::Vector<uint8_t>* buffer) {
     return Bitmap::read(reinterpret_cast<const char*>(buffer->data()), false);
 }
 
+/// View a vector of structs in the flatbuffer as an array of the in memory
+/// type without copying it.
+template <typename U, typename V>
+llvm::ArrayRef<U> as_array(const fbs::Vector<const V*>* vector) {
+    if(!vector) {
+        return {};
+    }
+
+    return llvm::ArrayRef<U>(safe_cast<U>(reinterpret_cast<const V*>(vector->Data())),
+                             vector->size());
+}
+
+template <typename T>
+llvm::ArrayRef<T> as_array(const fbs::Vector<T>* vector) {
+    if(!vector) {
+        return {};
+    }
+
+    return llvm::ArrayRef<T>(vector->data(), vector->size());
+}
+
 }  // namespace
 
 }  // namespace clice::index
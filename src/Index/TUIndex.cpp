@@ -1,17 +1,98 @@
 #include "AST/Semantic.h"
 #include "Index/TUIndex.h"
 #include "Support/Compare.h"
-#include "llvm/Support/SHA256.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/xxhash.h"
 
 namespace clice::index {
 
 namespace {
 
+/// Compute the fingerprint of the header context, see `TUIndex::build`.
+std::uint64_t fingerprint(CompilationUnit& unit, clang::FileID fid) {
+    llvm::SmallString<256> buffer;
+    auto add = [&buffer](llvm::StringRef data) {
+        auto size = static_cast<std::uint32_t>(data.size());
+        buffer.append(llvm::StringRef(reinterpret_cast<const char*>(&size), sizeof(size)));
+        buffer.append(data);
+    };
+
+    auto content_hash = llvm::xxh3_64bits(unit.file_content(fid));
+    add(llvm::StringRef(reinterpret_cast<const char*>(&content_hash), sizeof(content_hash)));
+    add(unit.file_path(fid));
+
+    auto& directives = unit.directives();
+    if(auto it = directives.find(fid); it != directives.end()) {
+        for(auto& condition: it->second.conditions) {
+            buffer.push_back(static_cast<char>(condition.value));
+        }
+
+        for(auto& macro: it->second.macros) {
+            if(macro.kind != MacroRef::Ref) {
+                continue;
+            }
+
+            add(unit.token_spelling(macro.loc));
+            for(auto& token: macro.macro->tokens()) {
+                add(unit.token_spelling(token.getLocation()));
+            }
+        }
+    }
+
+    return llvm::xxh3_64bits(buffer);
+}
+
 class Builder : public SemanticVisitor<Builder> {
 public:
-    Builder(TUIndex& result, CompilationUnit& unit) :
-        SemanticVisitor<Builder>(unit, false), result(result) {
+    Builder(TUIndex& result,
+            CompilationUnit& unit,
+            llvm::function_ref<bool(std::uint64_t)> is_known,
+            bool interested_only = false) :
+        SemanticVisitor<Builder>(unit, interested_only), result(result) {
         result.graph = IncludeGraph::from(unit);
+        if(interested_only) {
+            return;
+        }
+
+        result.content_hashes.resize(result.graph.paths.size());
+        for(auto& [fid, _]: result.graph.file_table) {
+            result.content_hashes[result.graph.path_id(fid)] =
+                llvm::xxh3_64bits(unit.file_content(fid));
+        }
+
+        if(!is_known) {
+            return;
+        }
+
+        for(auto& [fid, _]: result.graph.file_table) {
+            if(fid == unit.interested_file()) {
+                continue;
+            }
+
+            auto hash = fingerprint(unit, fid);
+            result.fingerprints.try_emplace(fid, hash);
+            if(is_known(hash)) {
+                result.skipped_files.insert(fid);
+            }
+        }
+    }
+
+    bool shouldSkipDecl(const clang::Decl* decl) {
+        if(result.skipped_files.empty()) {
+            return false;
+        }
+
+        /// Namespaces may span multiple files.
+        if(llvm::isa<clang::NamespaceDecl, clang::LinkageSpecDecl, clang::ExportDecl>(decl)) {
+            return false;
+        }
+
+        auto location = decl->getLocation();
+        if(location.isInvalid()) {
+            return false;
+        }
+
+        return result.skipped_files.contains(unit.file_id(unit.expansion_location(location)));
     }
 
     void handleDeclOccurrence(const clang::NamedDecl* decl,
@@ -34,6 +115,10 @@ public:
         }
 
         auto [fid, range] = unit.decompose_range(location);
+        if(result.skipped_files.contains(fid)) {
+            return;
+        }
+
         auto& index = result.file_indices[fid];
 
         auto symbol_id = unit.getSymbolID(decl);
@@ -55,6 +140,10 @@ public:
         }
 
         auto [fid, range] = unit.decompose_range(location);
+        if(result.skipped_files.contains(fid)) {
+            return;
+        }
+
         auto& index = result.file_indices[fid];
 
         auto symbol_id = unit.getSymbolID(def);
@@ -74,6 +163,9 @@ public:
                         const clang::NamedDecl* target,
                         clang::SourceRange range) {
         auto [fid, relationRange] = unit.decompose_expansion_range(range);
+        if(result.skipped_files.contains(fid)) {
+            return;
+        }
 
         Relation relation{.kind = kind};
 
@@ -105,17 +197,39 @@ public:
         run();
 
         for(auto& [fid, index]: result.file_indices) {
+            auto path_id = result.graph.path_id(fid);
             for(auto& [symbol_id, relations]: index.relations) {
                 std::ranges::sort(relations, refl::less);
                 auto range = std::ranges::unique(relations, refl::equal);
                 relations.erase(range.begin(), range.end());
-                result.symbols[symbol_id].reference_files.add(result.graph.path_id(fid));
+                result.symbols[symbol_id].reference_files.add(path_id);
+            }
+        }
+
+        /// The file also refers to the targets, so that the reverse relations
+        /// of them could be found from their files. Only the targets known after
+        /// all files are visited are recorded, regardless of the order of files.
+        for(auto& [fid, index]: result.file_indices) {
+            auto path_id = result.graph.path_id(fid);
+            for(auto& [symbol_id, relations]: index.relations) {
+                for(auto relation: relations) {
+                    if(!relation.kind.isBetweenSymbol() && !relation.kind.isCall()) {
+                        continue;
+                    }
+
+                    auto it = result.symbols.find(relation.target_symbol);
+                    if(it != result.symbols.end()) {
+                        it->second.reference_files.add(path_id);
+                    }
+                }
             }
 
             std::ranges::sort(index.occurrences, refl::less);
             auto range = std::ranges::unique(index.occurrences, refl::equal);
             index.occurrences.erase(range.begin(), range.end());
 
+            index.lines = LineTable::build(unit.file_content(fid));
+
             if(fid == unit.interested_file()) {
                 result.main_file_index = std::move(index);
             }
@@ -130,40 +244,102 @@ private:
 
 }  // namespace
 
-std::array<std::uint8_t, 32> FileIndex::hash() {
-    llvm::SHA256 hasher;
-
+IndexHash FileIndex::hash() {
     using u8 = std::uint8_t;
 
-    if(!occurrences.empty()) {
-        static_assert(sizeof(Occurrence) == sizeof(Range) + sizeof(SymbolHash));
-        static_assert(sizeof(Occurrence) % 8 == 0);
-        auto data = reinterpret_cast<u8*>(occurrences.data());
-        auto size = occurrences.size() * sizeof(Occurrence);
-        hasher.update(llvm::ArrayRef(data, size));
+    /// xxh3 has no streaming interface in LLVM. Hash every contiguous array in
+    /// place and then hash the digests, rather than copying all of them into a
+    /// single buffer.
+    llvm::SmallVector<std::uint64_t, 64> digests;
+    auto add = [&digests](llvm::ArrayRef<u8> data) {
+        auto digest = llvm::xxh3_128bits(data);
+        digests.emplace_back(digest.low64);
+        digests.emplace_back(digest.high64);
+    };
+
+    static_assert(sizeof(Occurrence) == sizeof(Range) + sizeof(SymbolHash));
+    static_assert(sizeof(Occurrence) % 8 == 0);
+    add(llvm::ArrayRef(reinterpret_cast<u8*>(occurrences.data()),
+                       occurrences.size() * sizeof(Occurrence)));
+
+    static_assert(sizeof(Relation) == sizeof(RelationKind) + 4 + sizeof(Range) + sizeof(SymbolHash));
+    static_assert(sizeof(Relation) % 8 == 0);
+    for(auto& [symbol_id, relations]: relations) {
+        digests.emplace_back(symbol_id);
+        add(llvm::ArrayRef(reinterpret_cast<u8*>(relations.data()),
+                           relations.size() * sizeof(Relation)));
     }
 
-    for(auto& [symbol_id, relations]: relations) {
-        hasher.update(std::bit_cast<std::array<u8, sizeof(symbol_id)>>(symbol_id));
-        static_assert(sizeof(Relation) ==
-                      sizeof(RelationKind) + 4 + sizeof(Range) + sizeof(SymbolHash));
-        static_assert(sizeof(Relation) % 8 == 0);
+    auto digest = llvm::xxh3_128bits(llvm::ArrayRef(reinterpret_cast<u8*>(digests.data()),
+                                                    digests.size() * sizeof(std::uint64_t)));
+    return IndexHash{digest.low64, digest.high64};
+}
+
+void FileIndex::lookup(std::uint32_t offset,
+                       llvm::function_ref<bool(const Occurrence&)> callback) const {
+    for(auto& occurrence: occurrences) {
+        if(occurrence.range.begin > offset) {
+            break;
+        }
+
+        if(offset <= occurrence.range.end && !callback(occurrence)) {
+            return;
+        }
+    }
+}
+
+void FileIndex::lookup(SymbolHash symbol,
+                       RelationKind kind,
+                       llvm::function_ref<bool(const Relation&)> callback) const {
+    auto it = relations.find(symbol);
+    if(it == relations.end()) {
+        return;
+    }
 
-        if(!relations.empty()) {
-            auto data = reinterpret_cast<u8*>(relations.data());
-            auto size = relations.size() * sizeof(Relation);
-            hasher.update(llvm::ArrayRef(data, size));
+    for(auto& relation: it->second) {
+        if(relation.kind & kind && !callback(relation)) {
+            return;
         }
     }
+}
+
+void FileIndex::reverse_lookup(SymbolHash target,
+                               RelationKind kind,
+                               llvm::function_ref<bool(SymbolHash, const Relation&)> callback) const {
+    for(auto& [symbol, symbol_relations]: relations) {
+        for(auto& relation: symbol_relations) {
+            if(!(relation.kind & kind)) {
+                continue;
+            }
 
-    return hasher.final();
+            /// Only the relations between symbols and calls have targets.
+            auto relation_kind = relation.kind;
+            if(!relation_kind.isBetweenSymbol() && !relation_kind.isCall()) {
+                continue;
+            }
+
+            if(relation.target_symbol == target && !callback(symbol, relation)) {
+                return;
+            }
+        }
+    }
+}
+
+TUIndex TUIndex::build(CompilationUnit& unit, llvm::function_ref<bool(std::uint64_t)> is_known) {
+    TUIndex index;
+    index.built_at = unit.build_at();
+
+    Builder builder(index, unit, is_known);
+    builder.build();
+
+    return index;
 }
 
-TUIndex TUIndex::build(CompilationUnit& unit) {
+TUIndex TUIndex::build_main_file(CompilationUnit& unit) {
     TUIndex index;
     index.built_at = unit.build_at();
 
-    Builder builder(index, unit);
+    Builder builder(index, unit, nullptr, true);
     builder.build();
 
     return index;
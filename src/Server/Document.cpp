@@ -296,6 +296,10 @@ async::Task<> Server::build_ast(std::string path, std::string content) {
     /// guard is destroyed.
     auto guard = co_await file->ast_built_lock.try_lock();
 
+    /// Background indexing backs off until the AST is built.
+    indexer.request_started();
+    auto finished = llvm::make_scope_exit([&] { indexer.request_finished(); });
+
     /// PCH is already updated.
     bool success = co_await build_pch(path, content);
     if(!success) {
@@ -340,12 +344,14 @@ async::Task<> Server::build_ast(std::string path, std::string content) {
                         {"diagnostics", std::move(diagnostics)},
     });
 
-    /// FIXME: Index the source file.
-    /// co_await indexer.index(*ast);
-
     /// Update built AST info.
     file->ast = std::make_shared<CompilationUnit>(std::move(*ast));
 
+    /// Index the main file with the AST in background, so that lookups in the
+    /// file reflect the unsaved content. Requests waiting for the AST are not
+    /// blocked by it.
+    indexer.index(path, file->ast);
+
     /// Dispose the task so that it will destroyed when task complete.
     file->ast_build_task.dispose();
 
@@ -380,23 +386,27 @@ async::Task<std::shared_ptr<OpenFile>> Server::add_document(std::string path, st
 
 async::Task<> Server::on_did_open(proto::DidOpenTextDocumentParams params) {
     auto path = mapping.to_path(params.textDocument.uri);
+    indexer.file_opened(path);
     auto file = co_await add_document(path, std::move(params.textDocument.text));
     co_return;
 }
 
 async::Task<> Server::on_did_change(proto::DidChangeTextDocumentParams params) {
     auto path = mapping.to_path(params.textDocument.uri);
+    indexer.file_edited(path);
     auto file = co_await add_document(path, std::move(params.contentChanges[0].text));
     co_return;
 }
 
 async::Task<> Server::on_did_save(proto::DidSaveTextDocumentParams params) {
     auto path = mapping.to_path(params.textDocument.uri);
+    indexer.file_changed(path);
     co_return;
 }
 
 async::Task<> Server::on_did_close(proto::DidCloseTextDocumentParams params) {
     auto path = mapping.to_path(params.textDocument.uri);
+    indexer.file_closed(path);
     co_return;
 }
 
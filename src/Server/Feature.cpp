@@ -322,4 +322,38 @@ auto Server::on_inlay_hint(proto::InlayHintParams params) -> Result {
     });
 }
 
+auto Server::on_workspace_symbol(proto::WorkspaceSymbolParams params) -> Result {
+    co_return json::serialize(co_await indexer.symbols(params.query));
+}
+
+auto Server::on_prepare_call_hierarchy(proto::CallHierarchyPrepareParams params) -> Result {
+    auto path = mapping.to_path(params.textDocument.uri);
+    auto opening_file = opening_files.get_or_add(path);
+    auto offset = to_offset(kind, opening_file->content, params.position);
+    co_return json::serialize(co_await indexer.prepare_hierarchy(path, offset));
+}
+
+auto Server::on_incoming_calls(proto::CallHierarchyIncomingCallsParams params) -> Result {
+    co_return json::serialize(co_await indexer.incoming_calls(params.item));
+}
+
+auto Server::on_outgoing_calls(proto::CallHierarchyOutgoingCallsParams params) -> Result {
+    co_return json::serialize(co_await indexer.outgoing_calls(params.item));
+}
+
+auto Server::on_prepare_type_hierarchy(proto::TypeHierarchyPrepareParams params) -> Result {
+    auto path = mapping.to_path(params.textDocument.uri);
+    auto opening_file = opening_files.get_or_add(path);
+    auto offset = to_offset(kind, opening_file->content, params.position);
+    co_return json::serialize(co_await indexer.prepare_hierarchy(path, offset));
+}
+
+auto Server::on_supertypes(proto::TypeHierarchySupertypesParams params) -> Result {
+    co_return json::serialize(co_await indexer.supertypes(params.item));
+}
+
+auto Server::on_subtypes(proto::TypeHierarchySubtypesParams params) -> Result {
+    co_return json::serialize(co_await indexer.subtypes(params.item));
+}
+
 }  // namespace clice
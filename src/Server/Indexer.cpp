@@ -1,26 +1,303 @@
+#include <numeric>
 
 #include "Compiler/Compilation.h"
 #include "Server/Indexer.h"
 #include "Server/Convert.h"
 #include "Support/Compare.h"
 #include "Support/Logging.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/xxhash.h"
 
 namespace clice {
 
-async::Task<> Indexer::index(llvm::StringRef path) {
-    CompilationParams params;
-    params.kind = CompilationUnit::Indexing;
-    params.arguments = database.lookup(path).arguments;
+void MergedIndexCache::refresh() {
+    if(items.empty()) {
+        return;
+    }
+
+    auto& entry = items.front();
+    auto bytes = entry.index.memory_usage();
+    used = used - entry.bytes + bytes;
+    entry.bytes = bytes;
+}
+
+void MergedIndexCache::evict() {
+    refresh();
+
+    /// Always keep the most recently used one, it may be still in use.
+    while(used > capacity && items.size() > 1) {
+        auto& entry = items.back();
+        if(entry.index.need_rewrite() && flusher) {
+            flusher(entry.path_id, std::move(entry.index));
+            stats.flushes += 1;
+        }
+
+        used -= entry.bytes;
+        table.erase(entry.path_id);
+        items.pop_back();
+        stats.evictions += 1;
+    }
+}
+
+index::MergedIndex* MergedIndexCache::get(std::uint32_t path_id) {
+    auto it = table.find(path_id);
+    if(it == table.end()) {
+        stats.misses += 1;
+        return nullptr;
+    }
+
+    stats.hits += 1;
+    refresh();
+
+    /// Move it to the front.
+    items.splice(items.begin(), items, it->second);
+    return &it->second->index;
+}
+
+index::MergedIndex& MergedIndexCache::add(std::uint32_t path_id, index::MergedIndex index) {
+    refresh();
+
+    if(auto it = table.find(path_id); it != table.end()) {
+        used -= it->second->bytes;
+        items.erase(it->second);
+        table.erase(it);
+    }
+
+    items.emplace_front(path_id, 0, std::move(index));
+    table.try_emplace(path_id, items.begin());
+    evict();
+
+    return items.front().index;
+}
+
+std::optional<std::int64_t> FileStatusCache::modified_time(std::uint32_t path_id,
+                                                           llvm::StringRef path) {
+    auto now = Clock::now();
+    auto [it, inserted] = entries.try_emplace(path_id);
+    auto& entry = it->second;
+    if(!inserted && now - entry.checked_at < ttl) {
+        return entry.time;
+    }
+
+    stat_count += 1;
+    entry.checked_at = now;
+    entry.time = std::nullopt;
+
+    fs::file_status status;
+    if(!fs::status(path, status)) {
+        entry.time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         status.getLastModificationTime().time_since_epoch())
+                         .count();
+    }
+    return entry.time;
+}
+
+std::optional<std::uint64_t> FileStatusCache::content_hash(std::uint32_t path_id,
+                                                           llvm::StringRef path) {
+    auto time = modified_time(path_id, path);
+    if(!time) {
+        return std::nullopt;
+    }
+
+    auto& entry = entries[path_id];
+    if(entry.hashed_time != time) {
+        auto content = fs::read(path);
+        entry.hash = content ? std::optional(llvm::xxh3_64bits(*content)) : std::nullopt;
+        entry.hashed_time = time;
+    }
+    return entry.hash;
+}
+
+namespace {
+
+/// Higher priority first, then earlier pushed first.
+constexpr auto item_order = [](const auto& item) {
+    return std::pair(item.priority, ~item.sequence);
+};
+
+}  // namespace
+
+void IndexQueue::push(std::uint32_t path_id, Priority priority) {
+    Item item{priority, next_sequence, path_id};
+    auto [it, inserted] = pending.try_emplace(path_id, item);
+    if(!inserted) {
+        if(it->second.priority >= priority) {
+            return;
+        }
+        counts[std::to_underlying(it->second.priority)] -= 1;
+        it->second = item;
+    }
+    counts[std::to_underlying(priority)] += 1;
+
+    heap.emplace_back(item);
+    ranges::push_heap(heap, {}, item_order);
+    next_sequence += 1;
+}
+
+void IndexQueue::discard_stale() {
+    while(!heap.empty()) {
+        auto& top = heap.front();
+        auto it = pending.find(top.path_id);
+        if(it != pending.end() && it->second.sequence == top.sequence) {
+            return;
+        }
+
+        ranges::pop_heap(heap, {}, item_order);
+        heap.pop_back();
+    }
+}
+
+auto IndexQueue::pop() -> std::pair<std::uint32_t, Priority> {
+    discard_stale();
+    assert(!heap.empty() && "pop from an empty queue");
+
+    ranges::pop_heap(heap, {}, item_order);
+    auto item = heap.back();
+    heap.pop_back();
+    pending.erase(item.path_id);
+    counts[std::to_underlying(item.priority)] -= 1;
+    return {item.path_id, item.priority};
+}
+
+auto IndexQueue::top_priority() -> Priority {
+    discard_stale();
+    assert(!heap.empty() && "peek an empty queue");
+    return heap.front().priority;
+}
+
+std::size_t IndexAdmission::job_memory() const {
+    if(recorded == 0) {
+        return DefaultJobMemory;
+    }
+
+    auto count = std::min(recorded, HistorySize);
+    auto peak = *std::max_element(peaks.begin(), peaks.begin() + count);
+    return std::max<std::size_t>(peak, 1);
+}
+
+std::size_t IndexAdmission::capacity(std::optional<std::size_t> available,
+                                     std::size_t settled,
+                                     std::size_t interactive) const {
+    auto limit = max_jobs;
+    if(interactive != 0) {
+        limit = std::max<std::size_t>(limit / 2, 1);
+    }
+
+    if(available) {
+        /// The memory which would be available if no job was running.
+        auto job = job_memory();
+        auto usable = *available + settled * (job / 2);
+        limit = std::min(limit, usable > headroom ? (usable - headroom) / job : 0);
+    }
+
+    return std::max<std::size_t>(limit, 1);
+}
+
+index::MergedIndex& Indexer::get_index(std::uint32_t path_id) {
+    if(auto index = in_memory_indices.get(path_id)) {
+        return *index;
+    }
+
+    /// An evicted index not written yet is newer than its file.
+    if(auto it = evicted_indices.find(path_id); it != evicted_indices.end()) {
+        auto index = std::move(it->second);
+        evicted_indices.erase(it);
+        return in_memory_indices.add(path_id, std::move(index));
+    }
+
+    index::MergedIndex index;
+    if(auto it = project_index.indices.find(path_id); it != project_index.indices.end()) {
+        index = index::MergedIndex::load(project_index.path_pool.path(it->second));
+    }
+
+    return in_memory_indices.add(path_id, std::move(index));
+}
 
+async::Task<> Indexer::index(llvm::StringRef path) {
     auto path_id = project_index.path_pool.path_id(path);
     auto& merged_index = get_index(path_id);
-    if(!merged_index.need_update(project_index.path_pool.paths)) {
+    auto modified_time = [this](std::uint32_t id) {
+        return file_status.modified_time(id, project_index.path_pool.path(id));
+    };
+    auto hash_content = [this](std::uint32_t id) {
+        return file_status.content_hash(id, project_index.path_pool.path(id));
+    };
+    llvm::function_ref<std::optional<std::uint64_t>(std::uint32_t)> content_hash;
+    if(config.project.compare_content) {
+        content_hash = hash_content;
+    }
+    if(!merged_index.need_update(modified_time, content_hash)) {
         LOGGING_INFO("Check update for {}, not need to update", path);
         co_return;
     }
 
-    /// FIXME: We may want to stop the task in the future.
-    /// params.stop;
+    if(!co_await index(path, path_id, true)) {
+        LOGGING_INFO("Known header indices of {} are dropped, index it again", path);
+        co_await index(path, path_id, false);
+    }
+}
+
+void Indexer::index(llvm::StringRef path, std::shared_ptr<CompilationUnit> unit) {
+    auto path_id = project_index.path_pool.path_id(path);
+
+    /// The index of an older AST would be stale.
+    cancel_main_file(path_id);
+    auto& task = main_file_jobs[path_id];
+    task = index_main_file(path_id, std::move(unit));
+    task.schedule();
+}
+
+async::Task<> Indexer::index_main_file(std::uint32_t path_id,
+                                       std::shared_ptr<CompilationUnit> unit) {
+    /// The task owns the AST, it stays valid even if the file is rebuilt or
+    /// closed meanwhile.
+    auto tu_index = co_await async::submit([&] { return index::TUIndex::build_main_file(*unit); });
+    dynamic_indices[path_id] =
+        std::make_shared<const index::FileIndex>(std::move(tu_index.main_file_index));
+
+    /// Dispose the task so that it is destroyed once it returns.
+    if(auto it = main_file_jobs.find(path_id); it != main_file_jobs.end()) {
+        it->second.dispose();
+        main_file_jobs.erase(it);
+    }
+}
+
+void Indexer::cancel_main_file(std::uint32_t path_id) {
+    if(auto it = main_file_jobs.find(path_id); it != main_file_jobs.end()) {
+        it->second.cancel();
+        it->second.dispose();
+        main_file_jobs.erase(it);
+    }
+}
+
+async::Task<bool> Indexer::index(llvm::StringRef path, std::uint32_t path_id, bool skip_known) {
+    CompilationParams params;
+    params.kind = CompilationUnit::Indexing;
+    params.arguments = database.lookup(path).arguments;
+
+    /// The job of the file is cancelled by setting the flag.
+    if(auto it = jobs.find(path_id); it != jobs.end()) {
+        params.stop = it->second.stop;
+        it->second.started = true;
+    }
+
+    llvm::SmallVector<std::uint32_t> path_map;
+    std::size_t peak_memory = 0;
+    running_jobs += 1;
+    fresh_jobs += 1;
+
+    /// If the job is cancelled, the frame is destroyed without being resumed.
+    /// Start the waiting files once the thread pool returns either way.
+    auto finished = llvm::make_scope_exit([this, stop = params.stop] {
+        running_jobs -= 1;
+        fresh_jobs = std::min(fresh_jobs, running_jobs);
+        if(stop && stop->load()) {
+            stopping_jobs -= 1;
+        }
+        dispatch();
+    });
 
     auto tu_index = co_await async::submit([&]() -> std::optional<index::TUIndex> {
         auto unit = compile(params);
@@ -29,21 +306,85 @@ async::Task<> Indexer::index(llvm::StringRef path) {
             return std::nullopt;
         }
 
-        return index::TUIndex::build(*unit);
+        auto is_known = [this](std::uint64_t fingerprint) {
+            return project_index.headers.contains(fingerprint);
+        };
+        auto tu_index = skip_known ? index::TUIndex::build(*unit, is_known)
+                                   : index::TUIndex::build(*unit);
+        peak_memory = unit->memory_usage();
+
+        /// Don't merge anything for a cancelled job.
+        if(params.stop->load()) {
+            return std::nullopt;
+        }
+
+        /// The symbol table and path pool of project index are thread-safe, merge
+        /// into them in the worker so that the main thread isn't blocked.
+        path_map = project_index.merge(tu_index);
+        return tu_index;
     });
 
+    if(peak_memory != 0) {
+        admission.record(peak_memory);
+    }
+
     if(!tu_index) {
-        co_return;
+        co_return true;
+    }
+
+    /// The header contexts are keyed by the source file, drop the stale ones
+    /// from last indexing first. Unchanged contexts keep their canonical ids.
+    /// A header may have multiple contexts in one unit, only drop them once.
+    llvm::DenseSet<std::uint32_t> cleared;
+    auto header_index = [&](clang::FileID fid) -> index::MergedIndex& {
+        auto header_id = path_map[tu_index->graph.path_id(fid)];
+        auto& merged_index = get_index(header_id);
+        if(cleared.insert(header_id).second) {
+            merged_index.remove(path_id);
+        }
+        return merged_index;
+    };
+
+    bool all_known = true;
+    for(auto fid: tu_index->skipped_files) {
+        auto fingerprint = tu_index->fingerprints[fid];
+        auto include_id = tu_index->graph.include_location_id(fid);
+        auto hash = project_index.headers.lookup(fingerprint);
+        if(!hash || !header_index(fid).merge(path_id, include_id, *hash)) {
+            project_index.headers.erase(fingerprint);
+            all_known = false;
+        }
     }
 
-    auto path_map = project_index.merge(*tu_index);
+    /// Group the header contexts by their headers and merge each group at once,
+    /// a header without include guard may have many contexts in one unit.
+    llvm::DenseMap<std::uint32_t, llvm::SmallVector<clang::FileID, 1>> header_files;
+    for(auto& [fid, _]: tu_index->file_indices) {
+        header_files[path_map[tu_index->graph.path_id(fid)]].emplace_back(fid);
+    }
 
     /// FIXME: Currently, we merge index eagerly, I would like to improve
     /// this in the future.
-    for(auto& [fid, index]: tu_index->file_indices) {
-        auto path_id = path_map[tu_index->graph.path_id(fid)];
-        auto& merged_index = get_index(path_id);
-        merged_index.merge(path_id, tu_index->graph.include_location_id(fid), index);
+    llvm::SmallVector<index::MergedIndex::PendingHeader> headers;
+    for(auto& [header_id, fids]: header_files) {
+        headers.clear();
+        for(auto fid: fids) {
+            headers.emplace_back(path_id,
+                                 tu_index->graph.include_location_id(fid),
+                                 &tu_index->file_indices.find(fid)->second);
+        }
+
+        auto hashes = header_index(fids.front()).merge_batch(headers);
+        for(std::size_t i = 0; i < fids.size(); i++) {
+            if(auto it = tu_index->fingerprints.find(fids[i]); it != tu_index->fingerprints.end()) {
+                project_index.headers.insert(it->second, hashes[i]);
+            }
+        }
+    }
+
+    std::vector<index::DependencyHash> dependencies;
+    for(std::size_t i = 0; i < tu_index->content_hashes.size(); i++) {
+        dependencies.emplace_back(path_map[i], 0, tu_index->content_hashes[i]);
     }
 
     auto& index = get_index(path_id);
@@ -53,66 +394,519 @@ async::Task<> Indexer::index(llvm::StringRef path) {
     index.merge(path_id,
                 tu_index->built_at,
                 std::move(tu_index->graph.locations),
-                tu_index->main_file_index);
+                tu_index->main_file_index,
+                std::move(dependencies));
+
+    for(auto& [header_id, _]: header_files) {
+        schedule_compact(header_id);
+    }
+    schedule_compact(path_id);
 
-    LOGGING_INFO("Successfully index {}", path);
+    LOGGING_INFO("Successfully index {}, skipped known header contexts: {}",
+                 path,
+                 tu_index->skipped_files.size());
+    co_return all_known;
 }
 
-async::Task<> Indexer::schedule_next() {
-    while(true) {
-        while(waitings.empty()) {
-            co_await update_event;
+void Indexer::schedule_compact(std::uint32_t path_id) {
+    auto index = in_memory_indices.get(path_id);
+    if(!index || !index->need_compact() || compacting.contains(path_id)) {
+        return;
+    }
+
+    compacting.insert(path_id);
+    auto task = compact(path_id, index->snapshot());
+    task.schedule();
+    task.dispose();
+}
+
+async::Task<> Indexer::compact(std::uint32_t path_id, index::MergedIndex snapshot) {
+    auto stats = co_await async::submit([&snapshot] { return snapshot.compact(); });
+    compacting.erase(path_id);
+
+    /// If the index was evicted in the meantime, its delta is written to disk
+    /// by the flush. Don't load it again just for rebasing.
+    if(!in_memory_indices.contains(path_id)) {
+        co_return;
+    }
+
+    auto& index = get_index(path_id);
+    if(index.rebase(std::move(snapshot))) {
+        LOGGING_INFO("Compact index for {}, dropped canonical ids: {}, occurrences: {}, "
+                     "relations: {}, reclaimed bytes: {}",
+                     project_index.path_pool.path(path_id),
+                     stats.canonical_ids,
+                     stats.occurrences,
+                     stats.relations,
+                     stats.reclaimed_bytes);
+    }
+}
+
+namespace {
+
+/// The names of directories holding third-party code by convention.
+constexpr llvm::StringRef third_party_dirs[] = {
+    "third_party",
+    "third-party",
+    "thirdparty",
+    "3rdparty",
+    "external",
+    "vendor",
+    "_deps",
+};
+
+/// The available memory of the system in bytes, nullopt if unknown.
+std::optional<std::size_t> system_available_memory() {
+#ifdef __linux__
+    /// The size of files in procfs is always zero, read it as a stream.
+    auto buffer = llvm::MemoryBuffer::getFileAsStream("/proc/meminfo");
+    if(!buffer) {
+        return std::nullopt;
+    }
+
+    llvm::SmallVector<llvm::StringRef> lines;
+    buffer.get()->getBuffer().split(lines, '\n', -1, false);
+    for(auto line: lines) {
+        auto [key, value] = line.split(':');
+        if(key != "MemAvailable") {
+            continue;
+        }
+
+        /// e.g. "MemAvailable:   12345678 kB"
+        std::size_t kilobytes;
+        if(value.trim().split(' ').first.getAsInteger(10, kilobytes)) {
+            return std::nullopt;
         }
+        return kilobytes * 1024;
+    }
+#endif
 
-        auto file_id = waitings.front();
-        waitings.pop_front();
+    return std::nullopt;
+}
 
-        auto file = project_index.path_pool.path(file_id);
+}  // namespace
 
-        auto i = 0;
-        for(; i < workings.size(); i++) {
-            if(workings[i].empty()) {
-                workings[i] = index(file);
-                break;
-            }
+IndexQueue::Priority Indexer::default_priority(llvm::StringRef path) {
+    llvm::StringRef workspace = config.workspace;
+    if(workspace.empty() || !path.starts_with(workspace)) {
+        return IndexQueue::Priority::Low;
+    }
+
+    /// Compare whole components, "/a/bc" is not in the workspace "/a/b".
+    auto relative = path.drop_front(workspace.size());
+    if(!relative.empty() && !path::is_separator(relative.front()) &&
+       !path::is_separator(workspace.back())) {
+        return IndexQueue::Priority::Low;
+    }
+
+    for(auto it = path::begin(relative), end = path::end(relative); it != end; ++it) {
+        if(llvm::is_contained(third_party_dirs, *it)) {
+            return IndexQueue::Priority::Low;
         }
+    }
+
+    return IndexQueue::Priority::Normal;
+}
+
+void Indexer::schedule(std::uint32_t path_id, IndexQueue::Priority priority) {
+    waitings.push(path_id, priority);
+    dispatch();
+}
 
-        co_await workings[i];
-        workings[i].release().destroy();
+auto Indexer::sources_of(llvm::StringRef path) -> llvm::SmallVector<std::uint32_t> {
+    auto path_id = project_index.path_pool.path_id(path);
+    if(source_files.contains(path_id)) {
+        return {path_id};
     }
+
+    /// A header is indexed in the contexts of the source files including it.
+    llvm::SmallVector<std::uint32_t> includers;
+    get_index(path_id).includers([&](std::uint32_t source) {
+        if(source_files.contains(source)) {
+            includers.emplace_back(source);
+        }
+    });
+    return includers;
 }
 
-async::Task<> Indexer::index_all() {
-    for(auto& file: database.files()) {
-        waitings.push_back(project_index.path_pool.path_id(file));
+void Indexer::boost(llvm::StringRef path) {
+    for(auto source: sources_of(path)) {
+        schedule(source, IndexQueue::Priority::High);
+    }
+}
+
+bool Indexer::admit(bool urgent) {
+    auto now = std::chrono::steady_clock::now();
+    if(now - memory_sampled_at >= admission_interval) {
+        available_memory = system_available_memory();
+        memory_sampled_at = now;
+        fresh_jobs = 0;
     }
 
-    auto max_count = std::max(std::thread::hardware_concurrency(), 4u);
+    auto capacity = admission.capacity(available_memory,
+                                       running_jobs - fresh_jobs,
+                                       urgent ? 0 : interactive_requests);
+    return running_jobs < (urgent ? capacity + 1 : capacity);
+}
+
+void Indexer::dispatch() {
+    while(!waitings.empty()) {
+        /// Don't let an urgent file wait for the files being indexed, stop the
+        /// files of low priority for it if there is still no room.
+        auto urgent = waitings.top_priority() == IndexQueue::Priority::High;
+        if(!admit(urgent)) {
+            if(urgent) {
+                preempt();
+            }
+            break;
+        }
+
+        /// A file being indexed is skipped, a changed file has its job cancelled
+        /// before being scheduled again.
+        auto [path_id, priority] = waitings.pop();
+        if(!source_files.contains(path_id) || jobs.contains(path_id)) {
+            continue;
+        }
 
-    /// FIXME: Currently, we just reserve two thread for other kind of tasks,
-    /// there may be a better way to handle this in the future ...
-    workings.resize(max_count - 2);
+        auto& job = jobs[path_id];
+        job.stop = std::make_shared<std::atomic_bool>(false);
+        job.priority = priority;
+        job.task = run_job(path_id);
+        job.task.schedule();
+    }
 
-    for(auto i = 0; i < max_count - 2; i++) {
-        auto task = schedule_next();
+    /// There are too many jobs for the available memory, or interactive requests
+    /// are waiting for the thread pool, check again later.
+    if(!waitings.empty() && !dispatch_pending) {
+        dispatch_pending = true;
+        auto task = dispatch_later();
         task.schedule();
         task.dispose();
     }
+}
+
+async::Task<> Indexer::dispatch_later() {
+    co_await async::sleep(admission_interval);
+    dispatch_pending = false;
+    dispatch();
+}
+
+async::Task<> Indexer::run_job(std::uint32_t path_id) {
+    co_await index(project_index.path_pool.path(path_id));
+
+    /// Dispose the task so that it is destroyed once it returns.
+    if(auto it = jobs.find(path_id); it != jobs.end()) {
+        it->second.task.dispose();
+        jobs.erase(it);
+    }
+    dispatch();
+}
+
+bool Indexer::cancel_job(std::uint32_t path_id) {
+    auto it = jobs.find(path_id);
+    if(it == jobs.end()) {
+        return false;
+    }
+
+    /// Stop the compilation, and the task is destroyed without merging anything
+    /// when the thread pool returns.
+    auto& job = it->second;
+    job.stop->store(true);
+    job.task.cancel();
+    job.task.dispose();
+    if(job.started) {
+        stopping_jobs += 1;
+    }
+    jobs.erase(it);
+    LOGGING_INFO("Cancel indexing {}", project_index.path_pool.path(path_id));
+    return true;
+}
+
+void Indexer::preempt() {
+    llvm::SmallVector<std::uint32_t> preemptible;
+    for(auto& [path_id, job]: jobs) {
+        if(job.started && job.priority == IndexQueue::Priority::Low) {
+            preemptible.emplace_back(path_id);
+        }
+    }
+
+    auto count = IndexAdmission::preemptions(waitings.count(IndexQueue::Priority::High),
+                                             stopping_jobs,
+                                             preemptible.size());
+    for(std::size_t i = 0; i < count; i++) {
+        cancel_job(preemptible[i]);
+        waitings.push(preemptible[i], IndexQueue::Priority::Low);
+    }
+}
+
+async::Task<> Indexer::index_all() {
+    for(auto& file: database.files()) {
+        auto path_id = project_index.path_pool.path_id(file);
+        source_files.insert(path_id);
+        waitings.push(path_id, default_priority(file));
+    }
 
+    /// By default, reserve two threads of the thread pool for other kind of tasks.
+    std::size_t max_count = config.project.max_index_jobs;
+    if(max_count == 0) {
+        max_count = std::max(std::thread::hardware_concurrency(), 4u) - 2;
+    }
+    admission.set_max_jobs(max_count);
+    admission.set_headroom(config.project.index_memory_headroom * 1024 * 1024);
+
+    /// Jobs beyond the capacity of admission wait in the queue, so the count of
+    /// running jobs follows the available memory.
+    dispatch();
     co_return;
 }
 
+namespace {
+
+/// Write the content to a new temporary file next to the output file, return
+/// the path of the temporary file. It could be called in the thread pool.
+std::optional<std::string> write_temp_file(llvm::StringRef output_path,
+                                           llvm::function_ref<void(llvm::raw_ostream&)> write) {
+    llvm::SmallString<128> temp_path;
+    if(auto err = fs::createUniqueFile(output_path + ".%%%%%%.tmp", temp_path)) {
+        LOGGING_INFO("Fail to create output file: {}, because: {}", output_path, err);
+        return std::nullopt;
+    }
+
+    auto clean_up = llvm::make_scope_exit([&temp_path] { fs::remove(temp_path); });
+
+    std::error_code err;
+    llvm::raw_fd_ostream os(temp_path, err, fs::CreationDisposition::CD_CreateAlways);
+    if(err) {
+        LOGGING_INFO("Fail to create output file: {}, because: {}", temp_path, err);
+        return std::nullopt;
+    }
+
+    write(os);
+    os.close();
+    if(os.has_error()) {
+        LOGGING_WARN("Fail to write file: {}, because: {}", temp_path, os.error());
+        os.clear_error();
+        return std::nullopt;
+    }
+
+    clean_up.release();
+    return temp_path.str().str();
+}
+
+/// Replace the output file with the temporary file atomically, so a crash never
+/// leaves a partially written file. The old file may be still mapped by in memory
+/// indices or their snapshots, renaming keeps it valid while truncating doesn't.
+bool commit_file(llvm::StringRef temp_path, llvm::StringRef output_path) {
+    if(auto err = fs::rename(temp_path, output_path)) {
+        LOGGING_WARN("Fail to rename file to {}, because: {}", output_path, err);
+        fs::remove(temp_path);
+        return false;
+    }
+    return true;
+}
+
+bool write_file(llvm::StringRef output_path, llvm::function_ref<void(llvm::raw_ostream&)> write) {
+    auto temp_path = write_temp_file(output_path, write);
+    return temp_path && commit_file(*temp_path, output_path);
+}
+
+}  // namespace
+
 void Indexer::load_from_disk() {
+    in_memory_indices.set_capacity(config.project.max_index_memory * 1024 * 1024);
+    started_at = std::chrono::system_clock::now();
+
+    /// The file is mapped and verified, symbols and names are decoded on demand,
+    /// so loading doesn't grow with the size of the project.
     std::string output_path = path::join(config.project.index_dir, "project.idx");
-    if(auto content = fs::read(output_path); content && !content->empty()) {
-        /// FIXME: from should return a expected ...
-        project_index = index::ProjectIndex::from(content->data());
+    if(auto loaded = index::ProjectIndex::load(output_path)) {
+        project_index = std::move(*loaded);
         LOGGING_INFO("Load project index form {} successfully", output_path);
     } else {
-        LOGGING_INFO("Fail to load project index form {}", output_path);
+        LOGGING_INFO("Fail to load project index form {}, because: {}",
+                     output_path,
+                     loaded.error());
+    }
+
+    /// The index files written after the project index was saved last time, the
+    /// server must have exited unexpectedly. Every index file is written
+    /// atomically, so they are complete and could be used directly.
+    std::string manifest_path = path::join(config.project.index_dir, "manifest");
+    if(auto content = fs::read(manifest_path)) {
+        llvm::SmallVector<llvm::StringRef> lines;
+        llvm::StringRef(*content).split(lines, '\n', -1, false);
+        for(auto line: lines) {
+            auto [source, index] = line.split('\t');
+            if(source.empty() || index.empty() || !fs::exists(index)) {
+                continue;
+            }
+
+            auto source_id = project_index.path_pool.path_id(source);
+            auto index_id = project_index.path_pool.path_id(index);
+            project_index.indices[source_id] = index_id;
+            unsaved_indices.try_emplace(source_id, index.str());
+        }
+        LOGGING_INFO("Recover {} index files from {}", unsaved_indices.size(), manifest_path);
+    }
+
+    if(config.project.index_flush_interval != 0) {
+        auto task = flush_periodically();
+        task.schedule();
+        task.dispose();
     }
 
-    /// FIXME: check indices update ....
+    /// Changed files are checked when they are indexed, only removed files
+    /// need sweeping.
+    auto task = sweep();
+    task.schedule();
+    task.dispose();
+}
+
+async::Task<> Indexer::sweep() {
+    struct IndexFile {
+        std::uint32_t source_id;
+
+        std::string source;
+
+        std::string index;
+    };
+
+    std::vector<IndexFile> files;
+    for(auto& [source_id, index_id]: project_index.indices) {
+        files.emplace_back(source_id,
+                           project_index.path_pool.path(source_id).str(),
+                           project_index.path_pool.path(index_id).str());
+    }
+
+    auto removed = co_await async::submit([&files, this] {
+        std::vector<std::uint32_t> removed;
+        llvm::StringSet<> referenced;
+        for(auto& file: files) {
+            if(fs::exists(file.source)) {
+                referenced.insert(file.index);
+            } else {
+                removed.emplace_back(file.source_id);
+            }
+        }
+
+        /// Delete the index files of removed files and the temporary files left
+        /// by crashes. Newer files than this server may be being written, keep them.
+        std::error_code err;
+        for(fs::directory_iterator it(config.project.index_dir, err), end; it != end && !err;
+            it.increment(err)) {
+            auto& file = it->path();
+            auto extension = path::extension(file);
+            if((extension != ".idx" && extension != ".tmp") || referenced.contains(file) ||
+               path::filename(file) == "project.idx") {
+                continue;
+            }
+
+            fs::file_status status;
+            if(fs::status(file, status) || status.getLastModificationTime() >= started_at) {
+                continue;
+            }
+
+            fs::remove(file);
+        }
+
+        return removed;
+    });
+
+    for(auto source_id: removed) {
+        project_index.indices.erase(source_id);
+        unsaved_indices.erase(source_id);
+    }
+    LOGGING_INFO("Sweep {} index files of removed files", removed.size());
+
+    /// Decode the names in background, so that the first workspace symbol
+    /// search doesn't wait for it.
+    co_await async::submit([this] { project_index.names(); });
+}
+
+void Indexer::file_changed(llvm::StringRef path) {
+    file_status.invalidate(project_index.path_pool.path_id(path));
+
+    /// The running jobs would merge the stale content, abort them first.
+    for(auto source: sources_of(path)) {
+        cancel_job(source);
+    }
+
+    /// An opened source file is looked up in its dynamic index, which is already
+    /// up to date, so it doesn't need to be indexed urgently.
+    auto path_id = project_index.path_pool.path_id(path);
+    if(source_files.contains(path_id) && dynamic_indices.contains(path_id)) {
+        schedule(path_id, IndexQueue::Priority::Normal);
+        return;
+    }
+    boost(path);
+}
+
+void Indexer::file_closed(llvm::StringRef path) {
+    auto path_id = project_index.path_pool.path_id(path);
+    cancel_main_file(path_id);
+    dynamic_indices.erase(path_id);
+}
+
+void Indexer::file_edited(llvm::StringRef path) {
+    auto path_id = project_index.path_pool.path_id(path);
+    if(cancel_job(path_id)) {
+        schedule(path_id, IndexQueue::Priority::Low);
+    }
+}
+
+void Indexer::file_opened(llvm::StringRef path) {
+    boost(path);
+}
+
+std::string Indexer::index_path(std::uint32_t path_id) {
+    if(auto it = project_index.indices.find(path_id); it != project_index.indices.end()) {
+        return project_index.path_pool.path(it->second).str();
+    }
+
+    auto path = project_index.path_pool.path(path_id);
+    return path::join(config.project.index_dir,
+                      std::format("{}.{}.idx", path::filename(path), llvm::xxHash64(path)));
+}
+
+bool Indexer::write_index(std::uint32_t path_id, index::MergedIndex& index) {
+    if(auto err = fs::create_directories(config.project.index_dir)) {
+        LOGGING_WARN("Fail to create index output dir: {}, because: {}",
+                     config.project.index_dir,
+                     err);
+        return false;
+    }
+
+    auto path = project_index.path_pool.path(path_id);
+    auto output_path = index_path(path_id);
+
+    /// Record it in the manifest before writing, the background write of an
+    /// older snapshot must not replace it.
+    background_writes.erase(path_id);
+    if(unsaved_indices.try_emplace(path_id, output_path).second && !write_manifest()) {
+        return false;
+    }
+
+    /// Mark the serialized snapshot as written, so a modification after it
+    /// keeps the index dirty.
+    auto snapshot = index.snapshot();
+    if(!write_file(output_path, [&snapshot](llvm::raw_ostream& os) { snapshot.serialize(os); })) {
+        return false;
+    }
+
+    auto opath_id = project_index.path_pool.path_id(output_path);
+    project_index.indices.try_emplace(path_id, opath_id);
+    index.mark_written(snapshot);
+    LOGGING_INFO("Successfully save index for {} to {}", path, output_path);
+    return true;
+}
+
+bool Indexer::write_manifest() {
+    std::string manifest_path = path::join(config.project.index_dir, "manifest");
+    return write_file(manifest_path, [this](llvm::raw_ostream& os) {
+        for(auto& [path_id, output_path]: unsaved_indices) {
+            os << project_index.path_pool.path(path_id) << '\t' << output_path << '\n';
+        }
+    });
 }
 
 void Indexer::save_to_disk() {
@@ -123,55 +917,301 @@ void Indexer::save_to_disk() {
         return;
     }
 
-    for(auto& [path_id, index]: in_memory_indices) {
-        if(index.need_rewrite()) {
-            auto path = project_index.path_pool.path(path_id);
+    /// Record all of them in the manifest at once.
+    for(auto& entry: in_memory_indices) {
+        if(entry.index.need_rewrite()) {
+            unsaved_indices.try_emplace(entry.path_id, index_path(entry.path_id));
+        }
+    }
+    for(auto& [path_id, _]: evicted_indices) {
+        unsaved_indices.try_emplace(path_id, index_path(path_id));
+    }
+    write_manifest();
+
+    for(auto& entry: in_memory_indices) {
+        if(entry.index.need_rewrite()) {
+            write_index(entry.path_id, entry.index);
+        }
+    }
+    for(auto& [path_id, index]: evicted_indices) {
+        write_index(path_id, index);
+    }
+    evicted_indices.clear();
+
+    auto& stats = in_memory_indices.statistics();
+    LOGGING_INFO(
+        "Index cache: {} indices, {} bytes, hits: {}, misses: {}, evictions: {}, flushes: {}",
+        in_memory_indices.size(),
+        in_memory_indices.memory_usage(),
+        stats.hits,
+        stats.misses,
+        stats.evictions,
+        stats.flushes);
 
-            std::string output_path;
-            if(auto it = project_index.indices.find(path_id); it != project_index.indices.end()) {
-                output_path = project_index.path_pool.path(it->second);
-            } else {
-                output_path = path::join(
-                    config.project.index_dir,
-                    std::format("{}.{}.idx", path::filename(path), llvm::xxHash64(path)));
+    std::string output_path = path::join(config.project.index_dir, "project.idx");
+    if(write_file(output_path, [this](llvm::raw_ostream& os) { project_index.serialize(os); })) {
+        unsaved_indices.clear();
+        fs::remove(path::join(config.project.index_dir, "manifest"));
+        LOGGING_INFO("Successfully save project index to {}", output_path);
+    }
+}
+
+async::Task<> Indexer::flush() {
+    if(flushing) {
+        flush_requested = true;
+        co_return;
+    }
+
+    if(auto err = fs::create_directories(config.project.index_dir)) {
+        LOGGING_WARN("Fail to create index output dir: {}, because: {}",
+                     config.project.index_dir,
+                     err);
+        co_return;
+    }
+
+    flushing = true;
+    auto guard = llvm::make_scope_exit([this] {
+        flushing = false;
+        background_writes.clear();
+        if(std::exchange(flush_requested, false)) {
+            request_flush();
+        }
+    });
+
+    struct PendingIndex {
+        std::uint32_t path_id;
+
+        std::string output_path;
+
+        /// The snapshot shares the immutable base, it is serialized in the thread
+        /// pool while the index keeps being modified.
+        index::MergedIndex snapshot;
+
+        std::optional<std::string> temp_path;
+    };
+
+    std::vector<PendingIndex> pendings;
+    for(auto& entry: in_memory_indices) {
+        if(entry.index.need_rewrite()) {
+            auto output_path = index_path(entry.path_id);
+            unsaved_indices.try_emplace(entry.path_id, output_path);
+            background_writes.insert(entry.path_id);
+            pendings.emplace_back(entry.path_id, output_path, entry.index.snapshot());
+        }
+    }
+
+    for(auto& [path_id, index]: evicted_indices) {
+        auto output_path = index_path(path_id);
+        unsaved_indices.try_emplace(path_id, output_path);
+        background_writes.insert(path_id);
+        pendings.emplace_back(path_id, output_path, index.snapshot());
+    }
+
+    if(pendings.empty()) {
+        co_return;
+    }
+
+    if(!write_manifest()) {
+        co_return;
+    }
+
+    std::size_t written = 0;
+    for(std::size_t i = 0; i < pendings.size(); i += flush_batch_size) {
+        auto batch = llvm::MutableArrayRef(pendings).slice(
+            i,
+            std::min(flush_batch_size, pendings.size() - i));
+
+        co_await async::submit([batch] {
+            for(auto& pending: batch) {
+                pending.temp_path = write_temp_file(pending.output_path,
+                                                    [&pending](llvm::raw_ostream& os) {
+                                                        pending.snapshot.serialize(os);
+                                                    });
+            }
+        });
+
+        /// Rename on the main thread, an index written directly in the meantime
+        /// is newer than the snapshot.
+        for(auto& pending: batch) {
+            if(!pending.temp_path) {
+                continue;
             }
 
-            std::error_code err;
-            llvm::raw_fd_ostream os(output_path, err, fs::CreationDisposition::CD_CreateAlways);
-            if(err) {
-                LOGGING_INFO("Fail to create output index file: {}, because: {}", output_path, err);
+            if(!background_writes.contains(pending.path_id)) {
+                fs::remove(*pending.temp_path);
                 continue;
             }
 
-            index.serialize(os);
+            if(!commit_file(*pending.temp_path, pending.output_path)) {
+                continue;
+            }
 
-            auto opath_id = project_index.path_pool.path_id(output_path);
-            project_index.indices.try_emplace(path_id, opath_id);
-            LOGGING_INFO("Successfully save index for {} to {}", path, output_path);
+            auto opath_id = project_index.path_pool.path_id(pending.output_path);
+            project_index.indices.try_emplace(pending.path_id, opath_id);
+            if(auto index = in_memory_indices.peek(pending.path_id)) {
+                index->mark_written(pending.snapshot);
+            } else if(auto it = evicted_indices.find(pending.path_id);
+                      it != evicted_indices.end() && it->second.mark_written(pending.snapshot)) {
+                /// The evicted index is dropped once it is written.
+                evicted_indices.erase(it);
+            }
+            written += 1;
         }
     }
 
+    LOGGING_INFO("Flush {} of {} modified indices to disk", written, pendings.size());
+    co_await save_project_index();
+}
+
+async::Task<> Indexer::save_project_index() {
+    /// The project index is serialized on the main thread, where the path map
+    /// of indices is modified, and written in the thread pool.
+    llvm::SmallString<0> data;
+    llvm::raw_svector_ostream os(data);
+    project_index.serialize(os);
+    auto saved = unsaved_indices;
+
     std::string output_path = path::join(config.project.index_dir, "project.idx");
+    bool success = co_await async::submit([&] {
+        return write_file(output_path, [&data](llvm::raw_ostream& os) { os << data; });
+    });
+    if(!success) {
+        co_return;
+    }
 
-    std::error_code err;
-    llvm::raw_fd_ostream os(output_path, err, fs::CreationDisposition::CD_CreateAlways);
-    if(err) {
-        LOGGING_INFO("Fail to create output index file: {}, because: {}", output_path, err);
-        return;
+    /// Indices written during saving are not in the saved project index yet.
+    for(auto& [path_id, output_path]: saved) {
+        unsaved_indices.erase(path_id);
     }
 
-    project_index.serialize(os);
+    if(unsaved_indices.empty()) {
+        fs::remove(path::join(config.project.index_dir, "manifest"));
+    } else {
+        write_manifest();
+    }
     LOGGING_INFO("Successfully save project index to {}", output_path);
 }
 
+void Indexer::request_flush() {
+    auto task = flush();
+    task.schedule();
+    task.dispose();
+}
+
+async::Task<> Indexer::flush_periodically() {
+    while(true) {
+        co_await async::sleep(std::chrono::seconds(config.project.index_flush_interval));
+        co_await flush();
+    }
+}
+
+std::vector<proto::Location>
+    Indexer::to_locations(index::LineTableRef lines,
+                          llvm::StringRef path,
+                          llvm::StringRef uri,
+                          llvm::ArrayRef<LocalSourceRange> source_ranges) const {
+    std::vector<proto::Location> results;
+
+    /// Convert with the line table of the indexed content, so the positions
+    /// match the offsets even if the file has changed on disk since.
+    if(!lines.empty()) {
+        auto units = [this](std::uint32_t length) -> std::uint32_t {
+            switch(encoding_kind) {
+                case PositionEncodingKind::UTF8: return length;
+                case PositionEncodingKind::UTF16: return length == 4 ? 2 : 1;
+                case PositionEncodingKind::UTF32: return 1;
+            }
+            std::unreachable();
+        };
+
+        auto to_position = [&](std::uint32_t offset) {
+            auto [line, character] = lines.position(offset, units);
+            return proto::Position{line, character};
+        };
+
+        for(auto range: source_ranges) {
+            results.emplace_back(uri,
+                                 proto::Range(to_position(range.begin),
+                                              to_position(range.end)));
+        }
+        return results;
+    }
+
+    /// Indices built before line tables are stored, fall back to the content.
+    auto content = fs::read(path);
+    if(!content) {
+        return {};
+    }
+
+    /// The ranges may overlap, convert their offsets in order first.
+    PositionConverter converter(*content, encoding_kind);
+    converter.to_positions(source_ranges);
+    for(auto range: source_ranges) {
+        results.emplace_back(uri, converter.lookup(range));
+    }
+    return results;
+}
+
+void Indexer::IndexView::lookup(
+    index::SymbolHash symbol,
+    RelationKind kind,
+    llvm::function_ref<bool(const index::Relation&)> callback) const {
+    if(dynamic) {
+        dynamic->lookup(symbol, kind, callback);
+    } else {
+        merged.lookup(symbol, kind, callback);
+    }
+}
+
+void Indexer::IndexView::reverse_lookup(
+    index::SymbolHash target,
+    RelationKind kind,
+    llvm::function_ref<bool(index::SymbolHash, const index::Relation&)> callback) const {
+    if(dynamic) {
+        dynamic->reverse_lookup(target, kind, callback);
+    } else {
+        merged.reverse_lookup(target, kind, callback);
+    }
+}
+
+index::LineTableRef Indexer::IndexView::lines() const {
+    return dynamic ? index::LineTableRef(dynamic->lines) : merged.lines();
+}
+
+auto Indexer::view(std::uint32_t path_id) -> IndexView {
+    if(auto it = dynamic_indices.find(path_id); it != dynamic_indices.end()) {
+        return IndexView{it->second};
+    }
+    return IndexView{nullptr, get_index(path_id).snapshot()};
+}
+
+void Indexer::add_opened_files(index::SymbolHash symbol, std::vector<std::uint32_t>& files) {
+    for(auto& [path_id, dynamic]: dynamic_indices) {
+        if(dynamic->relations.contains(symbol) && !llvm::is_contained(files, path_id)) {
+            files.emplace_back(path_id);
+        }
+    }
+}
+
+void Indexer::lookup_occurrences(std::uint32_t path_id,
+                                 std::uint32_t offset,
+                                 llvm::function_ref<bool(const index::Occurrence&)> callback) {
+    /// The offset is in the content of the editor, prefer the dynamic index of
+    /// an opened file, which reflects the unsaved changes.
+    if(auto it = dynamic_indices.find(path_id); it != dynamic_indices.end()) {
+        it->second->lookup(offset, callback);
+    } else {
+        get_index(path_id).lookup(offset, callback);
+    }
+}
+
 auto Indexer::lookup(llvm::StringRef path, std::uint32_t offset, RelationKind kind) -> Result {
     std::vector<proto::Location> locations;
 
     auto path_id = project_index.path_pool.path_id(path);
-    auto& index = get_index(path_id);
 
     llvm::SmallVector<index::Occurrence> occurrences;
-    index.lookup(offset, [&occurrences](const index::Occurrence& o) {
+    lookup_occurrences(path_id, offset, [&occurrences](const index::Occurrence& o) {
         occurrences.emplace_back(o);
         return true;
     });
@@ -181,34 +1221,59 @@ auto Indexer::lookup(llvm::StringRef path, std::uint32_t offset, RelationKind ki
 
     /// FIXME: We only handle first element now ...
     auto symbol_id = occurrences.front().target;
-    auto refs = project_index.symbols[symbol_id].reference_files;
-
-    /// FIXME: We may want to parallelize this ...
-    for(auto file: refs) {
-        std::vector<LocalSourceRange> results;
-        get_index(file).lookup(symbol_id, kind, [&results](const index::Relation& r) {
-            results.emplace_back(r.range);
-            return true;
-        });
-
-        llvm::StringRef path = project_index.path_pool.path(file);
 
-        /// FIXME: Use the content stored in the merged index.
-        auto content = fs::read(path);
-        if(!content) {
-            continue;
+    std::vector<std::uint32_t> files;
+    project_index.symbols.lookup(symbol_id, [&files](const index::Symbol& symbol) {
+        for(auto file: symbol.reference_files) {
+            files.emplace_back(file);
         }
+    });
+    add_opened_files(symbol_id, files);
+    if(files.empty()) {
+        co_return locations;
+    }
 
-        ranges::sort(results, refl::less);
-        PositionConverter converter(*content, this->encoding_kind);
+    /// Resolve the references in each file in the thread pool. The cache is
+    /// only touched on the main thread, workers get a snapshot of the index,
+    /// which shares the mapped file and stays valid even if the index is
+    /// evicted meanwhile. Opened files are resolved in their dynamic indices,
+    /// so the ranges match the unsaved content. The locations of each file go to
+    /// its own slot, so the result follows the order of files rather than the
+    /// order the tasks complete in.
+    std::vector<std::vector<proto::Location>> file_results(files.size());
+    std::vector<std::size_t> positions(files.size());
+    std::iota(positions.begin(), positions.end(), 0);
 
-        for(auto result: results) {
-            auto begin = converter.toPosition(result.begin);
-            auto end = converter.toPosition(result.end);
-            locations.emplace_back(mapping.to_uri(path), proto::Range(begin, end));
-        }
-    }
+    auto resolve = [&](std::size_t position) -> async::Task<bool> {
+        auto file = files[position];
+        std::string path = project_index.path_pool.path(file).str();
+        auto uri = mapping.to_uri(path);
+        auto view = this->view(file);
+
+        file_results[position] = co_await async::submit([&]() -> std::vector<proto::Location> {
+            std::vector<LocalSourceRange> relation_ranges;
+            view.lookup(symbol_id, kind, [&relation_ranges](const index::Relation& r) {
+                relation_ranges.emplace_back(r.range);
+                return true;
+            });
+            if(relation_ranges.empty()) {
+                return {};
+            }
+
+            ranges::sort(relation_ranges, refl::less);
+            return to_locations(view.lines(), path, uri, relation_ranges);
+        });
+        co_return true;
+    };
+
+    /// Bound the count of files in flight, so a symbol referenced by thousands
+    /// of files would not snapshot all of their indices at once.
+    auto concurrency = std::max(std::thread::hardware_concurrency(), 4u);
+    co_await async::gather(positions, resolve, concurrency);
 
+    for(auto& file_locations: file_results) {
+        locations.insert(locations.end(), file_locations.begin(), file_locations.end());
+    }
     co_return locations;
 }
 
@@ -229,4 +1294,409 @@ auto Indexer::references(llvm::StringRef path, std::uint32_t offset) -> Result {
         RelationKind(RelationKind::Declaration, RelationKind::Definition, RelationKind::Reference));
 }
 
+auto Indexer::locate(llvm::ArrayRef<index::SymbolHash> symbols,
+                     std::vector<std::vector<std::uint32_t>> files)
+    -> async::Task<std::vector<std::optional<SymbolLocation>>> {
+    /// The locations found so far of a symbol, with their positions in its files.
+    struct State {
+        std::optional<SymbolLocation> definition;
+        std::size_t definition_position = std::numeric_limits<std::size_t>::max();
+        std::optional<SymbolLocation> declaration;
+        std::size_t declaration_position = std::numeric_limits<std::size_t>::max();
+
+        /// The position of the next file to search.
+        std::size_t next = 0;
+    };
+
+    /// The symbols searched in a file, with the positions of the file in their files.
+    struct Query {
+        std::uint32_t file;
+        llvm::SmallVector<std::pair<std::size_t, std::size_t>, 1> symbols;
+    };
+
+    /// A location found in the thread pool.
+    struct Found {
+        std::size_t symbol;
+        std::size_t position;
+        bool definition;
+        SymbolLocation location;
+    };
+
+    std::vector<State> states(symbols.size());
+    for(std::size_t i = 0; i < symbols.size(); i++) {
+        /// The symbol may be only declared in the unsaved content of opened files.
+        add_opened_files(symbols[i], files[i]);
+    }
+
+    auto resolve = [&](Query& query) -> async::Task<bool> {
+        std::string path = project_index.path_pool.path(query.file).str();
+        auto uri = mapping.to_uri(path);
+        auto view = this->view(query.file);
+
+        auto found = co_await async::submit([&] {
+            auto locate = [&](index::SymbolHash symbol,
+                              RelationKind kind) -> std::optional<SymbolLocation> {
+                std::optional<index::Relation> relation;
+                view.lookup(symbol, kind, [&relation](const index::Relation& r) {
+                    relation = r;
+                    return false;
+                });
+                if(!relation) {
+                    return std::nullopt;
+                }
+
+                /// Macros only record the range of the name.
+                auto range = relation->definition_range();
+                if(range.begin > relation->range.begin || range.end < relation->range.end) {
+                    range = relation->range;
+                }
+
+                LocalSourceRange source_ranges[] = {range, relation->range};
+                auto locations = to_locations(view.lines(), path, uri, source_ranges);
+                if(locations.size() != 2) {
+                    return std::nullopt;
+                }
+                return SymbolLocation{uri, locations[0].range, locations[1].range};
+            };
+
+            std::vector<Found> result;
+            for(auto [i, position]: query.symbols) {
+                if(auto definition = locate(symbols[i], RelationKind::Definition)) {
+                    result.emplace_back(i, position, true, std::move(*definition));
+                } else if(auto declaration = locate(symbols[i], RelationKind::Declaration)) {
+                    result.emplace_back(i, position, false, std::move(*declaration));
+                }
+            }
+            return result;
+        });
+
+        for(auto& [i, position, definition, location]: found) {
+            auto& state = states[i];
+            if(definition && position < state.definition_position) {
+                state.definition = std::move(location);
+                state.definition_position = position;
+            } else if(!definition && position < state.declaration_position) {
+                state.declaration = std::move(location);
+                state.declaration_position = position;
+            }
+        }
+        co_return true;
+    };
+
+    /// Search the files of all symbols in rounds, the symbols sharing a file are
+    /// looked up together. A round takes a few more files of each symbol whose
+    /// definition is not found yet, doubling the count every round, so the first
+    /// file, usually a hint, is tried alone first.
+    auto concurrency = std::max(std::thread::hardware_concurrency(), 4u);
+    std::size_t batch = 1;
+    while(true) {
+        std::vector<Query> queries;
+        llvm::DenseMap<std::uint32_t, std::size_t> positions;
+        for(std::size_t i = 0; i < symbols.size(); i++) {
+            auto& state = states[i];
+            auto end = std::min(state.next + batch, files[i].size());
+            for(; !state.definition && state.next < end; state.next++) {
+                auto file = files[i][state.next];
+                auto [it, success] = positions.try_emplace(file, queries.size());
+                if(success) {
+                    queries.emplace_back(file);
+                }
+                queries[it->second].symbols.emplace_back(i, state.next);
+            }
+        }
+        if(queries.empty()) {
+            break;
+        }
+
+        co_await async::gather(queries, resolve, concurrency);
+        batch = std::min<std::size_t>(batch * 2, concurrency);
+    }
+
+    /// The definition in the earliest file is found before any later file is
+    /// searched, otherwise fall back to the declaration in the earliest file.
+    std::vector<std::optional<SymbolLocation>> locations;
+    locations.reserve(states.size());
+    for(auto& state: states) {
+        locations.emplace_back(state.definition ? std::move(state.definition)
+                                                : std::move(state.declaration));
+    }
+    co_return locations;
+}
+
+auto Indexer::symbols(llvm::StringRef query)
+    -> async::Task<std::vector<proto::SymbolInformation>> {
+    struct Candidate {
+        index::SymbolHash symbol;
+        std::string name;
+        SymbolKind kind = {};
+        std::vector<std::uint32_t> files;
+    };
+
+    std::vector<Candidate> candidates;
+    project_index.names().search(query,
+                                 max_workspace_symbols,
+                                 [&](index::SymbolHash symbol, llvm::StringRef name, float) {
+                                     candidates.emplace_back(symbol, name.str());
+                                 });
+
+    for(auto& candidate: candidates) {
+        project_index.symbols.lookup(candidate.symbol, [&](const index::Symbol& symbol) {
+            candidate.kind = symbol.kind;
+            for(auto file: symbol.reference_files) {
+                candidate.files.emplace_back(file);
+            }
+        });
+    }
+
+    std::vector<proto::SymbolInformation> result;
+    if(candidates.empty()) {
+        co_return result;
+    }
+
+    std::vector<index::SymbolHash> symbols;
+    std::vector<std::vector<std::uint32_t>> files;
+    for(auto& candidate: candidates) {
+        symbols.emplace_back(candidate.symbol);
+        files.emplace_back(std::move(candidate.files));
+    }
+    auto locations = co_await locate(symbols, std::move(files));
+
+    for(std::size_t i = 0; i < candidates.size(); i++) {
+        auto& candidate = candidates[i];
+        if(locations[i]) {
+            auto& location = *locations[i];
+            result.emplace_back(std::move(candidate.name),
+                                proto::kind_map(candidate.kind),
+                                proto::Location(std::move(location.uri), location.selection_range));
+        }
+    }
+    co_return result;
+}
+
+auto Indexer::hierarchy_items(llvm::ArrayRef<Edge> edges, bool hinted)
+    -> async::Task<std::vector<std::optional<proto::CallHierarchyItem>>> {
+    std::vector<std::optional<proto::CallHierarchyItem>> items(edges.size());
+
+    /// The symbols unknown to the project have no kind, they are skipped.
+    std::vector<std::size_t> indices;
+    std::vector<SymbolKind> kinds;
+    std::vector<index::SymbolHash> symbols;
+    std::vector<std::vector<std::uint32_t>> files;
+    for(std::size_t i = 0; i < edges.size(); i++) {
+        auto& edge = edges[i];
+        std::optional<SymbolKind> kind;
+        std::vector<std::uint32_t> candidates;
+        if(hinted) {
+            candidates.emplace_back(edge.file);
+        }
+        project_index.symbols.lookup(edge.target, [&](const index::Symbol& entry) {
+            kind = entry.kind;
+            for(auto file: entry.reference_files) {
+                if(!hinted || file != edge.file) {
+                    candidates.emplace_back(file);
+                }
+            }
+        });
+        if(!kind) {
+            continue;
+        }
+
+        indices.emplace_back(i);
+        kinds.emplace_back(*kind);
+        symbols.emplace_back(edge.target);
+        files.emplace_back(std::move(candidates));
+    }
+    if(symbols.empty()) {
+        co_return items;
+    }
+
+    auto locations = co_await locate(symbols, std::move(files));
+    for(std::size_t i = 0; i < symbols.size(); i++) {
+        auto& location = locations[i];
+        if(!location) {
+            continue;
+        }
+
+        auto& item = items[indices[i]].emplace();
+        item.name = project_index.names().name(symbols[i]).str();
+        item.kind = proto::kind_map(kinds[i]);
+        item.uri = std::move(location->uri);
+        item.range = location->range;
+        item.selectionRange = location->selection_range;
+        item.data = std::to_string(symbols[i]);
+    }
+    co_return items;
+}
+
+auto Indexer::prepare_hierarchy(llvm::StringRef path, std::uint32_t offset)
+    -> async::Task<std::vector<proto::CallHierarchyItem>> {
+    std::vector<proto::CallHierarchyItem> items;
+
+    auto path_id = project_index.path_pool.path_id(path);
+    std::optional<index::SymbolHash> symbol;
+    lookup_occurrences(path_id, offset, [&symbol](const index::Occurrence& o) {
+        symbol = o.target;
+        return false;
+    });
+    if(!symbol) {
+        co_return items;
+    }
+
+    Edge edge{*symbol, path_id};
+    auto found = co_await hierarchy_items(edge, true);
+    if(found.front()) {
+        items.emplace_back(std::move(*found.front()));
+    }
+    co_return items;
+}
+
+auto Indexer::edges(const proto::CallHierarchyItem& item, RelationKind kind, bool reverse)
+    -> async::Task<std::vector<Edge>> {
+    std::vector<Edge> result;
+
+    index::SymbolHash symbol;
+    if(llvm::StringRef(item.data).getAsInteger(10, symbol)) {
+        co_return result;
+    }
+
+    std::vector<std::uint32_t> files;
+    project_index.symbols.lookup(symbol, [&files](const index::Symbol& entry) {
+        for(auto file: entry.reference_files) {
+            files.emplace_back(file);
+        }
+    });
+    add_opened_files(symbol, files);
+    if(files.empty()) {
+        co_return result;
+    }
+
+    /// The files referencing the symbol include the files where it is the target
+    /// of relations, so the edges of any direction are found in these files
+    /// without recompiling.
+    llvm::DenseMap<index::SymbolHash, std::size_t> targets;
+    auto collect = [&](std::uint32_t file) -> async::Task<bool> {
+        std::string path = project_index.path_pool.path(file).str();
+        auto uri = mapping.to_uri(path);
+        auto view = this->view(file);
+
+        auto file_edges = co_await async::submit([&] {
+            /// In reverse, the other end of an edge is the source of the relation.
+            std::vector<index::Relation> relations;
+            if(reverse) {
+                view.reverse_lookup(
+                    symbol,
+                    kind,
+                    [&relations](index::SymbolHash source, const index::Relation& r) {
+                        relations.emplace_back(r).target_symbol = source;
+                        return true;
+                    });
+            } else {
+                view.lookup(symbol, kind, [&relations](const index::Relation& r) {
+                    relations.emplace_back(r);
+                    return true;
+                });
+            }
+
+            std::vector<Edge> file_edges;
+            if(relations.empty()) {
+                return file_edges;
+            }
+
+            /// Group the relations by their targets.
+            ranges::sort(relations, [](const index::Relation& lhs, const index::Relation& rhs) {
+                return std::tuple(lhs.target_symbol, lhs.range.begin, lhs.range.end) <
+                       std::tuple(rhs.target_symbol, rhs.range.begin, rhs.range.end);
+            });
+
+            std::vector<LocalSourceRange> relation_ranges;
+            if(kind.isCall()) {
+                for(auto& relation: relations) {
+                    relation_ranges.emplace_back(relation.range);
+                }
+            }
+            auto locations = to_locations(view.lines(), path, uri, relation_ranges);
+
+            for(std::size_t i = 0; i < relations.size(); i++) {
+                auto target = relations[i].target_symbol;
+                if(file_edges.empty() || file_edges.back().target != target) {
+                    file_edges.emplace_back(target, file);
+                }
+                if(i < locations.size()) {
+                    file_edges.back().ranges.emplace_back(locations[i].range);
+                }
+            }
+            return file_edges;
+        });
+
+        for(auto& edge: file_edges) {
+            auto [it, success] = targets.try_emplace(edge.target, result.size());
+            if(success) {
+                result.emplace_back(std::move(edge));
+            } else {
+                auto& edge_ranges = result[it->second].ranges;
+                edge_ranges.insert(edge_ranges.end(), edge.ranges.begin(), edge.ranges.end());
+            }
+        }
+        co_return true;
+    };
+
+    auto concurrency = std::max(std::thread::hardware_concurrency(), 4u);
+    co_await async::gather(files, collect, concurrency);
+    co_return result;
+}
+
+auto Indexer::incoming_calls(const proto::CallHierarchyItem& item)
+    -> async::Task<std::vector<proto::CallHierarchyIncomingCall>> {
+    std::vector<proto::CallHierarchyIncomingCall> calls;
+
+    /// The caller is usually defined in the file where it calls.
+    auto callers = co_await edges(item, RelationKind::Callee, true);
+    auto items = co_await hierarchy_items(callers, true);
+    for(std::size_t i = 0; i < callers.size(); i++) {
+        if(items[i]) {
+            calls.emplace_back(std::move(*items[i]), std::move(callers[i].ranges));
+        }
+    }
+    co_return calls;
+}
+
+auto Indexer::outgoing_calls(const proto::CallHierarchyItem& item)
+    -> async::Task<std::vector<proto::CallHierarchyOutgoingCall>> {
+    std::vector<proto::CallHierarchyOutgoingCall> calls;
+    auto callees = co_await edges(item, RelationKind::Callee);
+    auto items = co_await hierarchy_items(callees, false);
+    for(std::size_t i = 0; i < callees.size(); i++) {
+        if(items[i]) {
+            calls.emplace_back(std::move(*items[i]), std::move(callees[i].ranges));
+        }
+    }
+    co_return calls;
+}
+
+auto Indexer::supertypes(const proto::TypeHierarchyItem& item)
+    -> async::Task<std::vector<proto::TypeHierarchyItem>> {
+    std::vector<proto::TypeHierarchyItem> items;
+    auto bases = co_await edges(item, RelationKind::Base);
+    for(auto& base: co_await hierarchy_items(bases, false)) {
+        if(base) {
+            items.emplace_back(std::move(*base));
+        }
+    }
+    co_return items;
+}
+
+auto Indexer::subtypes(const proto::TypeHierarchyItem& item)
+    -> async::Task<std::vector<proto::TypeHierarchyItem>> {
+    std::vector<proto::TypeHierarchyItem> items;
+
+    /// The derived class is defined where its base specifier is.
+    auto derived = co_await edges(item, RelationKind::Base, true);
+    for(auto& entry: co_await hierarchy_items(derived, true)) {
+        if(entry) {
+            items.emplace_back(std::move(*entry));
+        }
+    }
+    co_return items;
+}
+
 }  // namespace clice
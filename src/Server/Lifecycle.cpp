@@ -69,6 +69,8 @@ async::Task<json::Value> Server::on_initialize(proto::InitializeParams params) {
     capabilities.declarationProvider.workDoneProgress = false;
     capabilities.definitionProvider.workDoneProgress = false;
     capabilities.referencesProvider.workDoneProgress = false;
+    capabilities.callHierarchyProvider.workDoneProgress = false;
+    capabilities.typeHierarchyProvider.workDoneProgress = false;
 
     /// DocumentSymbol
     capabilities.documentSymbolProvider = {};
@@ -1,5 +1,6 @@
 #include "Support/Logging.h"
 #include "Server/Server.h"
+#include "llvm/ADT/ScopeExit.h"
 
 namespace clice {
 
@@ -119,6 +120,15 @@ Server::Server() : indexer(database, config, kind) {
     register_callback<&Server::on_folding_range>("textDocument/foldingRange");
     register_callback<&Server::on_semantic_token>("textDocument/semanticTokens/full");
     register_callback<&Server::on_inlay_hint>("textDocument/inlayHint");
+
+    register_callback<&Server::on_prepare_call_hierarchy>("textDocument/prepareCallHierarchy");
+    register_callback<&Server::on_incoming_calls>("callHierarchy/incomingCalls");
+    register_callback<&Server::on_outgoing_calls>("callHierarchy/outgoingCalls");
+    register_callback<&Server::on_prepare_type_hierarchy>("textDocument/prepareTypeHierarchy");
+    register_callback<&Server::on_supertypes>("typeHierarchy/supertypes");
+    register_callback<&Server::on_subtypes>("typeHierarchy/subtypes");
+
+    register_callback<&Server::on_workspace_symbol>("workspace/symbol");
 }
 
 async::Task<> Server::on_receive(json::Value value) {
@@ -161,7 +171,14 @@ async::Task<> Server::on_receive(json::Value value) {
         auto start_time = std::chrono::steady_clock::now();
 
         LOGGING_INFO("<-- Handling request: {}({})", method, current_id);
-        auto result = co_await it->second(*this, std::move(params));
+        json::Value result;
+        {
+            /// Background indexing backs off while the request is handled, even
+            /// if the handler is cancelled.
+            indexer.request_started();
+            auto finished = llvm::make_scope_exit([&] { indexer.request_finished(); });
+            result = co_await it->second(*this, std::move(params));
+        }
         co_await response(std::move(*id), std::move(result));
 
         auto end_time = std::chrono::steady_clock::now();
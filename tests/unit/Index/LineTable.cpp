@@ -0,0 +1,52 @@
+#include "Test/Tester.h"
+#include "Index/LineTable.h"
+#include "Server/Convert.h"
+
+namespace clice::testing {
+
+namespace {
+
+suite<"LineTable"> suite = [] {
+    test("Position") = [&] {
+        llvm::StringRef content = "int x = 1;\n"
+                                  "// 你好, world\n"
+                                  "\n"
+                                  "auto s = \"😀a😀\";\n"
+                                  "é";
+
+        auto table = index::LineTable::build(content);
+        expect(eq(table.line_starts.size(), 5));
+        expect(eq(table.wide_chars.size(), 5));
+
+        for(auto [encoding, width]: {
+                std::pair{PositionEncodingKind::UTF8, 0u},
+                std::pair{PositionEncodingKind::UTF16, 16u},
+                std::pair{PositionEncodingKind::UTF32, 32u},
+        }) {
+            auto units = [&](std::uint32_t length) -> std::uint32_t {
+                if(width == 0) {
+                    return length;
+                }
+                return width == 16 && length == 4 ? 2 : 1;
+            };
+
+            PositionConverter converter(content, encoding);
+            index::LineTableRef lines = table;
+            for(std::uint32_t offset = 0; offset <= content.size(); offset++) {
+                /// Skip the offsets in the middle of a character.
+                if(offset < content.size() && (content[offset] & 0xC0) == 0x80) {
+                    continue;
+                }
+
+                auto expected = converter.toPosition(offset);
+                auto [line, character] = lines.position(offset, units);
+                expect(eq(line, expected.line));
+                expect(eq(character, expected.character));
+            }
+        }
+    };
+};
+
+}  // namespace
+
+}  // namespace clice::testing
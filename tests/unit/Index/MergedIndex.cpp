@@ -1,6 +1,8 @@
 #include "Test/Tester.h"
 #include "Index/MergedIndex.h"
 #include "Async/Async.h"
+#include "Support/Compare.h"
+#include "Support/FileSystem.h"
 
 namespace clice::testing {
 
@@ -71,6 +73,457 @@ suite<"MergedIndex"> suite = [] {
             expect(merged == view);
         }
     };
+
+    test("MappedLoad") = [&] {
+        build_index(R"(
+            #include <iostream>
+
+            int main () {
+                std::cout << "Hello world!" << std::endl;
+                return 0;
+            }
+        )");
+
+        auto& graph = tu_index.graph;
+        for(auto& [fid, index]: tu_index.file_indices) {
+            index::MergedIndex merged;
+            merged.merge(0, graph.include_location_id(fid), index);
+
+            llvm::SmallString<1024> s;
+            llvm::raw_svector_ostream os(s);
+            merged.serialize(os);
+
+            auto path = fs::createTemporaryFile("clice", "idx");
+            fatal / expect(that % path.has_value());
+            fatal / expect(that % fs::write(*path, s).has_value());
+
+            for(auto populate: {false, true}) {
+                auto loaded = index::MergedIndex::load(*path, populate);
+                auto lines = loaded.lines();
+                expect(that % (lines.line_starts == llvm::ArrayRef(index.lines.line_starts)));
+                expect(that % (lines.wide_chars == llvm::ArrayRef(index.lines.wide_chars)));
+                expect(merged == loaded);
+            }
+
+            /// A truncated file or a file of other format is loaded as an empty index.
+            fatal / expect(that % fs::write(*path, s.str().take_front(s.size() / 2)).has_value());
+            expect(that % index::MergedIndex::load(*path).lines().empty());
+
+            std::string garbage(s.size(), '\x7f');
+            fatal / expect(that % fs::write(*path, garbage).has_value());
+            expect(that % index::MergedIndex::load(*path).lines().empty());
+
+            fs::remove(*path);
+        }
+    };
+
+    test("LookupAfterMerge") = [&] {
+        /// Lookup between merges, every merged occurrence should be found.
+        index::MergedIndex merged;
+        auto merge_and_lookup = [&](std::uint32_t path_id, llvm::StringRef code) {
+            build_index(code);
+            auto& index = tu_index.main_file_index;
+            merged.merge(path_id, 0, index);
+
+            for(auto& occurrence: index.occurrences) {
+                bool found = false;
+                merged.lookup(occurrence.range.begin, [&](const index::Occurrence& o) {
+                    found = o == occurrence;
+                    return !found;
+                });
+                expect(that % found);
+            }
+        };
+
+        merge_and_lookup(0, R"(
+            int foo() { return 0; }
+        )");
+
+        merge_and_lookup(1, R"(
+            int foo() { return 0; }
+            int bar() { return foo(); }
+        )");
+    };
+
+    test("NestedLookup") = [&] {
+        /// Nested and overlapping ranges, including a range covering everything.
+        index::FileIndex file_index;
+        std::uint32_t seed = 42;
+        for(std::uint32_t i = 0; i < 1000; i++) {
+            seed = seed * 1103515245 + 12345;
+            auto begin = seed % 2000;
+            seed = seed * 1103515245 + 12345;
+            auto length = i % 10 == 0 ? seed % 500 : seed % 20;
+            file_index.occurrences.emplace_back(LocalSourceRange(begin, begin + length), i);
+        }
+        file_index.occurrences.emplace_back(LocalSourceRange(0, 3000), 1000);
+        ranges::sort(file_index.occurrences, refl::less);
+
+        index::MergedIndex merged;
+        merged.merge(0, 0, file_index);
+
+        llvm::SmallString<1024> s;
+        llvm::raw_svector_ostream os(s);
+        merged.serialize(os);
+        auto view = index::MergedIndex(s);
+
+        for(std::uint32_t offset = 0; offset < 2600; offset += 7) {
+            std::vector<index::Occurrence> expected;
+            for(auto& occurrence: file_index.occurrences) {
+                if(occurrence.range.contains(offset)) {
+                    expected.emplace_back(occurrence);
+                }
+            }
+
+            for(auto target: {&merged, &view}) {
+                std::vector<index::Occurrence> result;
+                target->lookup(offset, [&](const index::Occurrence& o) {
+                    result.emplace_back(o);
+                    return true;
+                });
+                ranges::sort(result, refl::less);
+                expect(that % (result == expected));
+            }
+        }
+    };
+
+    test("HierarchyRelations") = [&] {
+        build_index(R"(
+            struct Base {};
+            struct Derived : Base {};
+
+            int foo() { return 0; }
+            int bar() { return foo(); }
+        )");
+
+        auto symbol_of = [&](llvm::StringRef name) {
+            for(auto& [symbol_id, symbol]: tu_index.symbols) {
+                if(symbol.name == name) {
+                    return symbol_id;
+                }
+            }
+            return index::SymbolHash(0);
+        };
+
+        index::MergedIndex merged;
+        merged.merge(0, 0, tu_index.main_file_index);
+
+        llvm::SmallString<1024> s;
+        llvm::raw_svector_ostream os(s);
+        merged.serialize(os);
+        auto view = index::MergedIndex(s);
+
+        /// Both directions of an edge are found by either end.
+        auto expect_edge = [&](llvm::StringRef source, RelationKind kind, llvm::StringRef target) {
+            for(auto merged_index: {&merged, &view}) {
+                std::vector<index::SymbolHash> targets;
+                merged_index->lookup(symbol_of(source), kind, [&](const index::Relation& r) {
+                    targets.emplace_back(r.target_symbol);
+                    return true;
+                });
+                expect(eq(targets.size(), 1));
+                expect(that % llvm::is_contained(targets, symbol_of(target)));
+            }
+        };
+
+        expect_edge("foo", RelationKind::Caller, "bar");
+        expect_edge("bar", RelationKind::Callee, "foo");
+        expect_edge("Derived", RelationKind::Base, "Base");
+        expect_edge("Base", RelationKind::Derived, "Derived");
+    };
+
+    test("ReverseRelations") = [&] {
+        build_index(R"(
+            struct Base {};
+            struct Derived : Base {};
+            struct Other : Base {};
+
+            int foo() { return 0; }
+            int bar() { return foo(); }
+            int baz() { return foo() + bar(); }
+        )");
+
+        auto symbol_of = [&](llvm::StringRef name) {
+            for(auto& [symbol_id, symbol]: tu_index.symbols) {
+                if(symbol.name == name) {
+                    return symbol_id;
+                }
+            }
+            return index::SymbolHash(0);
+        };
+
+        index::MergedIndex merged;
+        merged.merge(0, 0, tu_index.main_file_index);
+
+        llvm::SmallString<1024> s;
+        llvm::raw_svector_ostream os(s);
+        merged.serialize(os);
+        auto view = index::MergedIndex(s);
+
+        /// The sources of the relations whose target is the symbol.
+        auto expect_sources = [&](llvm::StringRef target,
+                                  RelationKind kind,
+                                  std::vector<llvm::StringRef> expected) {
+            for(auto merged_index: {&merged, &view}) {
+                std::vector<index::SymbolHash> sources;
+                merged_index->reverse_lookup(
+                    symbol_of(target),
+                    kind,
+                    [&](index::SymbolHash source, const index::Relation& r) {
+                        expect(eq(r.target_symbol, symbol_of(target)));
+                        sources.emplace_back(source);
+                        return true;
+                    });
+                expect(eq(sources.size(), expected.size()));
+                for(auto name: expected) {
+                    expect(that % llvm::is_contained(sources, symbol_of(name)));
+                }
+            }
+
+            /// The dynamic index of an opened file is looked up the same way.
+            std::vector<index::SymbolHash> sources;
+            tu_index.main_file_index.reverse_lookup(
+                symbol_of(target),
+                kind,
+                [&](index::SymbolHash source, const index::Relation& r) {
+                    expect(eq(r.target_symbol, symbol_of(target)));
+                    sources.emplace_back(source);
+                    return true;
+                });
+            expect(eq(sources.size(), expected.size()));
+            for(auto name: expected) {
+                expect(that % llvm::is_contained(sources, symbol_of(name)));
+            }
+        };
+
+        expect_sources("foo", RelationKind::Callee, {"bar", "baz"});
+        expect_sources("bar", RelationKind::Callee, {"baz"});
+        expect_sources("baz", RelationKind::Callee, {});
+        expect_sources("Base", RelationKind::Base, {"Derived", "Other"});
+        expect_sources("Base", RelationKind::Callee, {});
+    };
+
+    test("DeltaMerge") = [&] {
+        build_index(R"(
+            #include <iostream>
+
+            int main () {
+                std::cout << "Hello world!" << std::endl;
+                return 0;
+            }
+        )");
+
+        /// Merge all file indices into one index, compact it after every merge so
+        /// that each merge goes to the delta over an immutable base.
+        index::MergedIndex expected;
+        index::MergedIndex merged;
+        std::uint32_t path_id = 0;
+        for(auto& [fid, index]: tu_index.file_indices) {
+            expected.merge(path_id, 0, index);
+            merged.merge(path_id, 0, index);
+            path_id += 1;
+
+            auto snapshot = merged.snapshot();
+            snapshot.compact();
+            expect(that % merged.rebase(std::move(snapshot)));
+            expect(that % merged.need_rewrite());
+
+            /// Merge it again in another context, which only hits the canonical cache.
+            merged.merge(path_id, 1, index);
+            expected.merge(path_id, 1, index);
+        }
+
+        auto kind = RelationKind(RelationKind::Declaration,
+                                 RelationKind::Definition,
+                                 RelationKind::Reference);
+        for(auto& [fid, index]: tu_index.file_indices) {
+            for(auto& occurrence: index.occurrences) {
+                auto offset = occurrence.range.begin;
+
+                llvm::SmallVector<index::Occurrence> lhs, rhs;
+                expected.lookup(offset, [&](const index::Occurrence& o) {
+                    lhs.emplace_back(o);
+                    return true;
+                });
+                merged.lookup(offset, [&](const index::Occurrence& o) {
+                    rhs.emplace_back(o);
+                    return true;
+                });
+                ranges::sort(lhs, refl::less);
+                ranges::sort(rhs, refl::less);
+                expect(that % (lhs == rhs));
+            }
+
+            for(auto& [symbol, _]: index.relations) {
+                std::vector<index::Relation> lhs, rhs;
+                expected.lookup(symbol, kind, [&](const index::Relation& r) {
+                    lhs.emplace_back(r);
+                    return true;
+                });
+                merged.lookup(symbol, kind, [&](const index::Relation& r) {
+                    rhs.emplace_back(r);
+                    return true;
+                });
+                ranges::sort(lhs, refl::less);
+                ranges::sort(rhs, refl::less);
+                expect(that % refl::equal(lhs, rhs));
+            }
+        }
+
+        expect(expected == merged);
+    };
+
+    test("BatchMerge") = [&] {
+        build_index(R"(
+            #include <iostream>
+
+            int main () {
+                std::cout << "Hello world!" << std::endl;
+                return 0;
+            }
+        )");
+
+        /// Merge all file indices into one index, the first one twice.
+        index::MergedIndex expected;
+        llvm::SmallVector<index::MergedIndex::PendingHeader> headers;
+        std::uint32_t path_id = 0;
+        for(auto& [fid, index]: tu_index.file_indices) {
+            expected.merge(path_id, 0, index);
+            headers.emplace_back(path_id, 0, &index);
+            path_id += 1;
+        }
+        expected.merge(path_id, 1, *headers.front().index);
+        headers.emplace_back(path_id, 1, headers.front().index);
+
+        index::MergedIndex merged;
+        auto hashes = merged.merge_batch(headers);
+        expect(eq(hashes.size(), headers.size()));
+        expect(that % (hashes.front() == hashes.back()));
+        expect(expected == merged);
+    };
+
+    test("SharedContexts") = [&] {
+        /// Two versions of the same file, the occurrences of `foo` are in both
+        /// canonical contexts and those of `bar` and `baz` are only in one.
+        index::MergedIndex merged;
+        build_index("int foo(); int bar();");
+        merged.merge(0, 0, tu_index.main_file_index);
+        build_index("int foo(); int baz();");
+        merged.merge(1, 0, tu_index.main_file_index);
+
+        llvm::SmallString<1024> s;
+        llvm::raw_svector_ostream os(s);
+        merged.serialize(os);
+
+        auto view = index::MergedIndex(s);
+        expect(merged == view);
+    };
+
+    test("ContentStaleness") = [&] {
+        index::MergedIndex merged;
+        index::FileIndex file;
+        std::vector<index::IncludeLocation> includes = {{.path_id = 1, .line = 1}};
+        merged.merge(0, std::chrono::milliseconds(100), includes, file, {{0, 0, 10}, {1, 0, 11}});
+
+        /// The header is touched after building.
+        std::int64_t times[] = {50, 200};
+        std::uint64_t hashes[] = {10, 11};
+        auto modified_time = [&](std::uint32_t id) -> std::optional<std::int64_t> {
+            return times[id];
+        };
+        auto content_hash = [&](std::uint32_t id) -> std::optional<std::uint64_t> {
+            return hashes[id];
+        };
+
+        llvm::SmallString<1024> s;
+        llvm::raw_svector_ostream os(s);
+        merged.serialize(os);
+        auto view = index::MergedIndex(s);
+
+        for(auto target: {&merged, &view}) {
+            hashes[1] = 11;
+            expect(that % target->need_update(modified_time));
+            expect(that % !target->need_update(modified_time, content_hash));
+
+            hashes[1] = 12;
+            expect(that % target->need_update(modified_time, content_hash));
+        }
+    };
+
+    test("StaleCompaction") = [&] {
+        build_index(R"(
+            int main () {
+                return 0;
+            }
+        )");
+
+        index::MergedIndex merged;
+        merged.merge(0, 0, tu_index.main_file_index);
+
+        auto snapshot = merged.snapshot();
+        merged.remove(0);
+        snapshot.compact();
+        expect(that % !merged.rebase(std::move(snapshot)));
+    };
+
+    test("SnapshotCopyOnWrite") = [&] {
+        build_index(R"(
+            int foo() { return 0; }
+            int bar() { return foo(); }
+        )");
+
+        auto serialize = [](const index::MergedIndex& merged) {
+            std::string data;
+            llvm::raw_string_ostream os(data);
+            merged.serialize(os);
+            return data;
+        };
+
+        index::MergedIndex merged;
+        merged.merge(0, 0, tu_index.main_file_index);
+
+        /// The snapshot keeps the delta when it was taken.
+        auto snapshot = merged.snapshot();
+        auto data = serialize(snapshot);
+        merged.remove(0);
+        merged.merge(1, 0, tu_index.main_file_index);
+        expect(that % (serialize(snapshot) == data));
+        expect(that % (serialize(merged) != data));
+        expect(that % !merged.mark_written(snapshot));
+    };
+
+    test("Compact") = [&] {
+        build_index(R"(
+            int foo() {
+                return 0;
+            }
+        )");
+        auto dead = tu_index.main_file_index;
+
+        build_index(R"(
+            int main () {
+                return 0;
+            }
+        )");
+        auto& alive = tu_index.main_file_index;
+
+        index::MergedIndex merged;
+        merged.merge(1, 0, dead);
+        merged.merge(0, 0, alive);
+        merged.remove(1);
+        expect(that % merged.need_compact());
+
+        auto stats = merged.compact();
+        expect(eq(stats.canonical_ids, 1));
+        expect(that % (stats.occurrences != 0));
+        expect(that % (stats.reclaimed_bytes != 0));
+
+        /// The alive index is renumbered to the first canonical id.
+        index::MergedIndex expected;
+        expected.merge(0, 0, alive);
+        expected.remove(1);
+        expect(expected == merged);
+    };
 };
 
 }  // namespace
@@ -0,0 +1,76 @@
+#include "Test/Tester.h"
+#include "Index/NameIndex.h"
+
+namespace clice::testing {
+
+namespace {
+
+suite<"NameIndex"> suite = [] {
+    auto search = [](const index::NameIndex& target, llvm::StringRef query) {
+        std::vector<std::string> names;
+        target.search(query, 100, [&](index::SymbolHash, llvm::StringRef name, float) {
+            names.emplace_back(name);
+        });
+        return names;
+    };
+
+    index::NameIndex name_index;
+    name_index.insert({
+        {1, "FuzzyMatcher"},
+        {2, "fuzzy_find"},
+        {3, "MergedIndex"},
+        {4, "merge"},
+        {5, "merge"},
+        {6, "PathPool"},
+        {7, ""},
+    });
+
+    test("Search") = [&] {
+        expect(eq(name_index.size(), 5));
+
+        auto names = search(name_index, "fuzmat");
+        expect(eq(names.size(), 1));
+        expect(eq(names[0], "FuzzyMatcher"));
+
+        /// Trigrams across segment heads.
+        names = search(name_index, "fma");
+        expect(eq(names.size(), 1));
+        expect(eq(names[0], "FuzzyMatcher"));
+
+        /// Overloads share the same name.
+        names = search(name_index, "merge");
+        expect(eq(names.size(), 3));
+        expect(eq(names[0], "merge"));
+        expect(eq(names[1], "merge"));
+        expect(eq(names[2], "MergedIndex"));
+
+        /// Short queries match the start of names.
+        expect(eq(search(name_index, "fu").size(), 2));
+        expect(eq(search(name_index, "p").size(), 1));
+        expect(eq(search(name_index, "pp").size(), 1));
+        expect(eq(search(name_index, "xyz").size(), 0));
+
+        /// Empty query matches all.
+        expect(eq(search(name_index, "").size(), 6));
+    };
+
+    test("Serialization") = [&] {
+        llvm::SmallString<1024> s;
+        llvm::raw_svector_ostream os(s);
+        name_index.serialize(os);
+
+        auto loaded = index::NameIndex::from(s.data());
+        expect(eq(loaded.size(), name_index.size()));
+        for(auto query: {"fuzmat", "fma", "merge", "fu", "p", "mi", ""}) {
+            auto lhs = search(name_index, query);
+            auto rhs = search(loaded, query);
+            ranges::sort(lhs);
+            ranges::sort(rhs);
+            expect(eq(lhs, rhs));
+        }
+    };
+};
+
+}  // namespace
+
+}  // namespace clice::testing
@@ -0,0 +1,132 @@
+#include <thread>
+#include "Test/Tester.h"
+#include "Index/ProjectIndex.h"
+#include "Support/FileSystem.h"
+
+namespace clice::testing {
+
+namespace {
+
+suite<"ProjectIndex"> suite = [] {
+    test("ConcurrentMerge") = [&] {
+        index::ProjectIndex project;
+
+        /// Every thread merges the same symbols referenced from its own files and
+        /// some shared files, in different orders.
+        constexpr std::uint32_t thread_count = 8;
+        constexpr std::uint32_t symbol_count = 2000;
+        std::vector<llvm::SmallVector<std::uint32_t>> path_maps(thread_count);
+        std::vector<std::thread> threads;
+        for(std::uint32_t t = 0; t < thread_count; t++) {
+            threads.emplace_back([&, t] {
+                index::TUIndex tu_index;
+                for(std::uint32_t i = 0; i < 1500; i++) {
+                    auto shared = (i * 7 + t * 13) % 1500;
+                    tu_index.graph.paths.emplace_back(std::format("/shared/{}.h", shared));
+                }
+                tu_index.graph.paths.emplace_back(std::format("/main/{}.cpp", t));
+
+                for(std::uint32_t i = 0; i < symbol_count; i++) {
+                    auto& symbol = tu_index.symbols[index::SymbolHash(i) * 0x9E3779B97F4A7C15];
+                    symbol.reference_files.add(i % 1500);
+                    symbol.reference_files.add(1500);
+                }
+
+                path_maps[t] = project.merge(tu_index);
+            });
+        }
+
+        for(auto& thread: threads) {
+            thread.join();
+        }
+
+        auto& pool = project.path_pool;
+        expect(eq(pool.size(), 1500 + thread_count));
+        for(std::uint32_t t = 0; t < thread_count; t++) {
+            for(std::uint32_t i = 0; i < 1500; i++) {
+                auto shared = std::format("/shared/{}.h", (i * 7 + t * 13) % 1500);
+                expect(eq(pool.path(path_maps[t][i]).str(), shared));
+            }
+            expect(eq(pool.path(path_maps[t][1500]).str(), std::format("/main/{}.cpp", t)));
+        }
+
+        expect(eq(project.symbols.size(), symbol_count));
+        auto check = [&](index::ProjectIndex& project) {
+            for(std::uint32_t i = 0; i < symbol_count; i++) {
+                auto found = project.symbols.lookup(
+                    index::SymbolHash(i) * 0x9E3779B97F4A7C15,
+                    [&](const index::Symbol& symbol) {
+                        expect(eq(symbol.reference_files.cardinality(), 2 * thread_count));
+                    });
+                expect(that % found);
+            }
+        };
+        check(project);
+
+        index::IndexHash hash{42, 43};
+        project.headers.insert(7, hash);
+
+        llvm::SmallString<1024> s;
+        llvm::raw_svector_ostream os(s);
+        project.serialize(os);
+
+        auto loaded = index::ProjectIndex::from(s.data());
+        expect(eq(loaded.symbols.size(), symbol_count));
+        expect(eq(loaded.path_pool.size(), pool.size()));
+        for(std::uint32_t i = 0; i < pool.size(); i++) {
+            expect(eq(loaded.path_pool.path(i).str(), pool.path(i).str()));
+            expect(eq(loaded.path_pool.path_id(pool.path(i)), i));
+        }
+        check(loaded);
+
+        auto loaded_hash = loaded.headers.lookup(7);
+        fatal / expect(that % loaded_hash.has_value());
+        expect(that % (*loaded_hash == hash));
+        expect(that % !loaded.headers.contains(8));
+    };
+
+    test("Load") = [&] {
+        index::ProjectIndex project;
+        index::TUIndex tu_index;
+        tu_index.graph.paths.emplace_back("/main.cpp");
+        for(std::uint32_t i = 0; i < 100; i++) {
+            auto& symbol = tu_index.symbols[index::SymbolHash(i) * 0x9E3779B97F4A7C15];
+            symbol.name = std::format("symbol{}", i);
+            symbol.reference_files.add(0);
+        }
+        project.merge(tu_index);
+
+        llvm::SmallString<1024> s;
+        llvm::raw_svector_ostream os(s);
+        project.serialize(os);
+
+        auto path = fs::createTemporaryFile("clice", "idx");
+        fatal / expect(that % path.has_value());
+        fatal / expect(that % fs::write(*path, s).has_value());
+
+        auto loaded = index::ProjectIndex::load(*path);
+        fatal / expect(that % loaded.has_value());
+        expect(eq(loaded->symbols.size(), 100));
+        expect(that % loaded->symbols.lookup(index::SymbolHash(42) * 0x9E3779B97F4A7C15,
+                                             [](const index::Symbol& symbol) {
+                                                 expect(that % symbol.reference_files.contains(0));
+                                             }));
+        expect(that % !loaded->symbols.lookup(1, [](const index::Symbol&) {}));
+
+        std::size_t count = 0;
+        loaded->names().search("symbol4", 100, [&](index::SymbolHash, llvm::StringRef, float) {
+            count += 1;
+        });
+        expect(that % count != 0);
+
+        /// A truncated file is rejected.
+        fatal / expect(that % fs::write(*path, s.str().take_front(s.size() / 2)).has_value());
+        expect(that % !index::ProjectIndex::load(*path).has_value());
+
+        fs::remove(*path);
+    };
+};
+
+}  // namespace
+
+}  // namespace clice::testing
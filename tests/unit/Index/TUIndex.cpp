@@ -246,6 +246,103 @@ suite<"TUIndex"> suite = [] {
         go_to_definition("implicit", "primary");
         go_to_definition("implicit2", "primary");
     };
+
+    test("Hash") = [&] {
+        build_index("int foo(); int bar() { return foo(); }");
+        auto hash = tu_index.main_file_index.hash();
+
+        build_index("int foo(); int bar() { return foo(); }");
+        expect(that % (tu_index.main_file_index.hash() == hash));
+
+        build_index("int foo(); int baz() { return foo(); }");
+        expect(that % (tu_index.main_file_index.hash() != hash));
+    };
+
+    test("SkipKnownHeaders") = [&] {
+        llvm::DenseSet<std::uint64_t> known;
+        auto build_with_known = [&](llvm::StringRef code) {
+            tester.clear();
+            tester.add_files("main.cpp", code);
+            fatal / expect(tester.compile());
+
+            tu_index = index::TUIndex::build(*tester.unit, [&](std::uint64_t fingerprint) {
+                return known.contains(fingerprint);
+            });
+        };
+
+        llvm::StringRef header = R"(
+#[header.h]
+#ifdef WIDE
+using value = long;
+#else
+using value = int;
+#endif
+int foo();
+)";
+
+        build_with_known((header + R"(
+#[main.cpp]
+#include "header.h"
+int bar() { return foo(); }
+)").str());
+        expect(eq(tu_index.fingerprints.size(), 1));
+        expect(eq(tu_index.file_indices.size(), 1));
+        expect(eq(tu_index.skipped_files.size(), 0));
+        auto fingerprint = tu_index.fingerprints.begin()->second;
+        auto occurrences = tu_index.main_file_index.occurrences.size();
+        known.insert(fingerprint);
+
+        /// The same header context is neither visited nor indexed again.
+        build_with_known((header + R"(
+#[main.cpp]
+#include "header.h"
+int bar() { return foo(); }
+)").str());
+        expect(eq(tu_index.skipped_files.size(), 1));
+        expect(eq(tu_index.file_indices.size(), 0));
+        expect(eq(tu_index.fingerprints.begin()->second, fingerprint));
+        expect(eq(tu_index.main_file_index.occurrences.size(), occurrences));
+
+        /// Different macro state gives a different fingerprint.
+        build_with_known((header + R"(
+#[main.cpp]
+#define WIDE
+#include "header.h"
+int bar() { return foo(); }
+)").str());
+        expect(eq(tu_index.skipped_files.size(), 0));
+        expect(eq(tu_index.file_indices.size(), 1));
+        expect(that % (tu_index.fingerprints.begin()->second != fingerprint));
+    };
+
+    test("MainFileOnly") = [&] {
+        tester.clear();
+        tester.add_files("main.cpp", R"(
+#[header.h]
+int foo();
+struct Bar { int x; };
+
+#[main.cpp]
+#include "header.h"
+int baz() { return $(call)foo(); }
+)");
+        fatal / expect(tester.compile());
+
+        auto full = index::TUIndex::build(*tester.unit);
+        tu_index = index::TUIndex::build_main_file(*tester.unit);
+
+        /// The header is not visited.
+        expect(eq(tu_index.file_indices.size(), 0));
+        expect(that % (tu_index.main_file_index.hash() == full.main_file_index.hash()));
+
+        std::vector<index::Occurrence> occurrences;
+        tu_index.main_file_index.lookup(tester.point("call"), [&](const index::Occurrence& o) {
+            occurrences.emplace_back(o);
+            return true;
+        });
+        fatal / expect(eq(occurrences.size(), 1));
+        expect(that % (occurrences == select("call")));
+    };
 };
 
 }  // namespace
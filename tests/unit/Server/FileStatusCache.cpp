@@ -0,0 +1,67 @@
+#include "Test/Test.h"
+#include "Server/Indexer.h"
+#include "Support/FileSystem.h"
+
+namespace clice::testing {
+
+namespace {
+
+suite<"FileStatusCache"> file_status_cache = [] {
+    test("Cached") = [&] {
+        auto path = fs::createTemporaryFile("clice", "cpp");
+        fatal / expect(that % path.has_value());
+
+        FileStatusCache cache;
+        auto time = cache.modified_time(0, *path);
+        expect(that % time.has_value());
+        expect(that % (cache.modified_time(0, *path) == time));
+        expect(that % cache.stats() == 1);
+
+        /// The removed file is still cached until invalidated.
+        fs::remove(*path);
+        expect(that % cache.modified_time(0, *path).has_value());
+        cache.invalidate(0);
+        expect(that % !cache.modified_time(0, *path).has_value());
+        expect(that % cache.stats() == 2);
+    };
+
+    test("Expired") = [&] {
+        auto path = fs::createTemporaryFile("clice", "cpp");
+        fatal / expect(that % path.has_value());
+
+        FileStatusCache cache;
+        cache.set_ttl(std::chrono::milliseconds(0));
+        expect(that % cache.modified_time(0, *path).has_value());
+
+        fs::remove(*path);
+        expect(that % !cache.modified_time(0, *path).has_value());
+        expect(that % cache.stats() == 2);
+    };
+
+    test("ContentHash") = [&] {
+        auto path = fs::createTemporaryFile("clice", "cpp");
+        fatal / expect(that % path.has_value());
+        fatal / expect(that % fs::write(*path, "int x;").has_value());
+
+        FileStatusCache cache;
+        auto hash = cache.content_hash(0, *path);
+        expect(that % hash.has_value());
+
+        /// Rewrite the same content, the hash is unchanged.
+        fatal / expect(that % fs::write(*path, "int x;").has_value());
+        cache.invalidate(0);
+        expect(that % (cache.content_hash(0, *path) == hash));
+
+        fatal / expect(that % fs::write(*path, "int y;").has_value());
+        cache.invalidate(0);
+        expect(that % (cache.content_hash(0, *path) != hash));
+
+        fs::remove(*path);
+        cache.invalidate(0);
+        expect(that % !cache.content_hash(0, *path).has_value());
+    };
+};
+
+}  // namespace
+
+}  // namespace clice::testing
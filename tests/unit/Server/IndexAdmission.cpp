@@ -0,0 +1,68 @@
+#include "Test/Test.h"
+#include "Server/Indexer.h"
+
+namespace clice::testing {
+
+namespace {
+
+suite<"IndexAdmission"> index_admission = [] {
+    constexpr std::size_t MiB = 1024 * 1024;
+
+    test("JobMemory") = [&] {
+        IndexAdmission admission;
+        expect(that % admission.job_memory() == IndexAdmission::DefaultJobMemory);
+
+        admission.record(100 * MiB);
+        admission.record(300 * MiB);
+        admission.record(200 * MiB);
+        expect(that % admission.job_memory() == 300 * MiB);
+
+        /// The old peaks are forgotten.
+        for(std::size_t i = 0; i < IndexAdmission::HistorySize; i++) {
+            admission.record(50 * MiB);
+        }
+        expect(that % admission.job_memory() == 50 * MiB);
+    };
+
+    test("Capacity") = [&] {
+        IndexAdmission admission;
+        admission.set_max_jobs(8);
+        admission.set_headroom(100 * MiB);
+        admission.record(100 * MiB);
+
+        /// Limited by the count of jobs.
+        expect(that % admission.capacity(std::nullopt, 0, 0) == 8);
+        expect(that % admission.capacity(10000 * MiB, 0, 0) == 8);
+
+        /// Limited by the available memory.
+        expect(that % admission.capacity(400 * MiB, 0, 0) == 3);
+        expect(that % admission.capacity(400 * MiB, 2, 0) == 4);
+
+        /// At least one job is allowed.
+        expect(that % admission.capacity(50 * MiB, 0, 0) == 1);
+    };
+
+    test("Interactive") = [&] {
+        IndexAdmission admission;
+        admission.set_max_jobs(8);
+        expect(that % admission.capacity(std::nullopt, 0, 1) == 4);
+
+        admission.set_max_jobs(1);
+        expect(that % admission.capacity(std::nullopt, 0, 2) == 1);
+    };
+
+    test("Preemptions") = [&] {
+        /// Limited by the jobs which could be stopped.
+        expect(that % IndexAdmission::preemptions(3, 0, 1) == 1);
+        expect(that % IndexAdmission::preemptions(3, 0, 8) == 3);
+
+        /// The stopping jobs leave room for some of the urgent files.
+        expect(that % IndexAdmission::preemptions(3, 1, 8) == 2);
+        expect(that % IndexAdmission::preemptions(1, 2, 8) == 0);
+        expect(that % IndexAdmission::preemptions(0, 0, 8) == 0);
+    };
+};
+
+}  // namespace
+
+}  // namespace clice::testing
@@ -0,0 +1,75 @@
+#include "Test/Test.h"
+#include "Server/Indexer.h"
+
+namespace clice::testing {
+
+namespace {
+
+suite<"IndexQueue"> index_queue = [] {
+    using enum IndexQueue::Priority;
+
+    auto pop_all = [](IndexQueue& queue) {
+        std::vector<std::uint32_t> result;
+        while(!queue.empty()) {
+            result.emplace_back(queue.pop().first);
+        }
+        return result;
+    };
+
+    test("Order") = [&] {
+        IndexQueue queue;
+        queue.push(1, Normal);
+        queue.push(2, Low);
+        queue.push(3, High);
+        queue.push(4, Normal);
+        queue.push(5, High);
+
+        expect(that % (queue.top_priority() == High));
+        expect(that % (pop_all(queue) == std::vector<std::uint32_t>{3, 5, 1, 4, 2}));
+    };
+
+    test("Dedupe") = [&] {
+        IndexQueue queue;
+        queue.push(1, Normal);
+        queue.push(2, Normal);
+        queue.push(1, Normal);
+        queue.push(2, Low);
+        expect(that % queue.size() == 2);
+        expect(that % (pop_all(queue) == std::vector<std::uint32_t>{1, 2}));
+    };
+
+    test("Raise") = [&] {
+        IndexQueue queue;
+        queue.push(1, Low);
+        queue.push(2, Normal);
+        queue.push(1, High);
+        expect(that % queue.size() == 2);
+        expect(that % queue.contains(1));
+
+        auto [path_id, priority] = queue.pop();
+        expect(that % path_id == 1);
+        expect(that % (priority == High));
+        expect(that % (pop_all(queue) == std::vector<std::uint32_t>{2}));
+        expect(that % !queue.contains(1));
+    };
+
+    test("Count") = [&] {
+        IndexQueue queue;
+        queue.push(1, High);
+        queue.push(2, Low);
+        queue.push(3, Low);
+        queue.push(3, High);
+        expect(that % queue.count(High) == 2);
+        expect(that % queue.count(Normal) == 0);
+        expect(that % queue.count(Low) == 1);
+
+        queue.pop();
+        queue.pop();
+        expect(that % queue.count(High) == 0);
+        expect(that % queue.count(Low) == 1);
+    };
+};
+
+}  // namespace
+
+}  // namespace clice::testing
@@ -0,0 +1,115 @@
+#include "Test/Test.h"
+#include "Server/Indexer.h"
+
+namespace clice::testing {
+
+namespace {
+
+suite<"MergedIndexCache"> merged_index_cache = [] {
+    /// An index backed by a buffer of given size, whose memory usage is exactly the size.
+    auto make_index = [](llvm::StringRef data) {
+        return index::MergedIndex(data);
+    };
+
+    test("HitAndMiss") = [&] {
+        MergedIndexCache cache;
+        std::string data(16, '\0');
+
+        expect(that % cache.get(1) == nullptr);
+        cache.add(1, make_index(data));
+        expect(that % cache.get(1) != nullptr);
+        expect(that % cache.contains(1));
+
+        auto& stats = cache.statistics();
+        expect(that % stats.hits == 1);
+        expect(that % stats.misses == 1);
+        expect(that % stats.evictions == 0);
+        expect(that % cache.memory_usage() == 16);
+    };
+
+    test("LruEviction") = [&] {
+        MergedIndexCache cache;
+        cache.set_capacity(300);
+        std::string data(100, '\0');
+
+        cache.add(1, make_index(data));
+        cache.add(2, make_index(data));
+        cache.add(3, make_index(data));
+        expect(that % cache.size() == 3);
+
+        /// Touch 1 so that 2 becomes the least recently used one.
+        expect(that % cache.get(1) != nullptr);
+
+        cache.add(4, make_index(data));
+        expect(that % cache.size() == 3);
+        expect(that % cache.memory_usage() == 300);
+        expect(that % !cache.contains(2));
+        expect(that % cache.contains(1));
+        expect(that % cache.contains(3));
+        expect(that % cache.contains(4));
+        expect(that % cache.statistics().evictions == 1);
+    };
+
+    test("KeepMostRecent") = [&] {
+        MergedIndexCache cache;
+        cache.set_capacity(10);
+        std::string data(100, '\0');
+
+        cache.add(1, make_index(data));
+        cache.add(2, make_index(data));
+        expect(that % cache.size() == 1);
+        expect(that % cache.contains(2));
+    };
+
+    test("FlushDirty") = [&] {
+        MergedIndexCache cache;
+        cache.set_capacity(0);
+
+        llvm::SmallVector<std::uint32_t> flushed;
+        cache.set_flusher([&](std::uint32_t path_id, index::MergedIndex index) {
+            expect(that % index.need_rewrite());
+            flushed.emplace_back(path_id);
+        });
+
+        /// Empty indices are clean, they are dropped without flushing.
+        cache.add(1, index::MergedIndex());
+        cache.add(2, index::MergedIndex());
+        expect(that % flushed.empty());
+        expect(that % cache.statistics().flushes == 0);
+
+        auto make_dirty = [] {
+            index::MergedIndex index;
+            index::FileIndex file;
+            index.merge(0, 0, file);
+            return index;
+        };
+
+        cache.add(3, make_dirty());
+        cache.add(4, make_dirty());
+        expect(that % flushed.size() == 1);
+        expect(that % flushed[0] == 3);
+        expect(that % cache.statistics().flushes == 1);
+    };
+
+    test("MarkWritten") = [&] {
+        MergedIndexCache cache;
+        index::FileIndex file;
+        auto& index = cache.add(1, index::MergedIndex());
+        index.merge(0, 0, file);
+
+        /// A snapshot taken before the last modification is stale.
+        auto snapshot = index.snapshot();
+        index.merge(1, 0, file);
+        expect(that % !index.mark_written(snapshot));
+        expect(that % index.need_rewrite());
+
+        snapshot = index.snapshot();
+        expect(that % cache.peek(1)->mark_written(snapshot));
+        expect(that % !index.need_rewrite());
+        expect(that % cache.statistics().hits == 0);
+    };
+};
+
+}  // namespace
+
+}  // namespace clice::testing
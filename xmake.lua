@@ -155,6 +155,13 @@ target("unit_tests")
         )
     end)
 
+target("index_benchmark")
+    set_default(false)
+    set_kind("binary")
+    add_files("bin/index_benchmark.cc")
+
+    add_deps("clice-core")
+
 target("integration_tests")
     set_default(false)
     set_kind("phony")